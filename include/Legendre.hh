@@ -4,14 +4,19 @@
 #include <complex>
 #include "ivanp/math/math.hh"
 
-// (Sum[c(k) LegendreP[k,x], {k, 0, 6, 2}])^2
-double Legendre(double x, const double* c) {
-  using namespace ivanp::math;
+// Legendre polynomials P2, P4, P6 of x
+inline void Legendre_basis(double x, double& p2, double& p4, double& p6) {
   const double x2 = x*x, x4 = x2*x2, x6 = x4*x2;
 
-  const double p2 = 1.5*x2 - 0.5;
-  const double p4 = 4.375*x4 - 3.75*x2 + 0.375;
-  const double p6 = 14.4375*x6 - 19.6875*x4 + 6.5625*x2 - 0.3125;
+  p2 = 1.5*x2 - 0.5;
+  p4 = 4.375*x4 - 3.75*x2 + 0.375;
+  p6 = 14.4375*x6 - 19.6875*x4 + 6.5625*x2 - 0.3125;
+}
+
+// (Sum[c(k) LegendreP[k,x], {k, 0, 6, 2}])^2
+// for precomputed LegendreP[k,x]
+inline double Legendre(double p2, double p4, double p6, const double* c) {
+  using namespace ivanp::math;
 
   const double c0 = std::sqrt(
     0.5 - (0.2*sq(c[0]) + (1./9.)*sq(c[1]) + (1./13.)*sq(c[2])) );
@@ -24,4 +29,43 @@ double Legendre(double x, const double* c) {
   return std::norm( c0 + c[0]*phase*p2 + c[1]*p4 + c[2]*p6 );
 }
 
+// (Sum[c(k) LegendreP[k,x], {k, 0, 6, 2}])^2
+inline double Legendre(double x, const double* c) {
+  double p2, p4, p6;
+  Legendre_basis(x,p2,p4,p6);
+  return Legendre(p2,p4,p6,c);
+}
+
+// Legendre(p2,p4,p6,c) and its derivatives
+// with respect to c2, c4, c6, phi2 in grad
+inline double Legendre(
+  double p2, double p4, double p6, const double* c, double* grad
+) {
+  using namespace ivanp::math;
+
+  const double c0 = std::sqrt(
+    0.5 - (0.2*sq(c[0]) + (1./9.)*sq(c[1]) + (1./13.)*sq(c[2])) );
+
+  const auto phase = std::polar<double>(1.,c[3]);
+  const auto a = c0 + c[0]*phase*p2 + c[1]*p4 + c[2]*p6;
+  const auto b = std::conj(a)*phase;
+
+  // d|a|^2 = 2 Re(conj(a) da)
+  // c0 depends on c2, c4, c6 through the normalization
+  grad[0] = 2.*(b.real()*p2 - (0.2*c[0]/c0)*a.real());
+  grad[1] = 2.*(p4 - (1./9.)*c[1]/c0)*a.real();
+  grad[2] = 2.*(p6 - (1./13.)*c[2]/c0)*a.real();
+  grad[3] = -2.*c[0]*p2*b.imag();
+
+  return std::norm(a);
+}
+
+// Legendre(x,c) and its derivatives
+// with respect to c2, c4, c6, phi2 in grad
+inline double Legendre(double x, const double* c, double* grad) {
+  double p2, p4, p6;
+  Legendre_basis(x,p2,p4,p6);
+  return Legendre(p2,p4,p6,c,grad);
+}
+
 #endif
@@ -0,0 +1,213 @@
+#ifndef ASYNC_WRITER_HH
+#define ASYNC_WRITER_HH
+
+// Buffered output files written by a background thread
+// Records are appended to a large per-file buffer. Full buffers are
+// handed to the I/O thread through a lock-free queue and come back
+// through another one to be reused, so the producing thread does not
+// wait for the filesystem unless the I/O thread falls far behind.
+// The I/O thread polls the queue while buffers keep coming,
+// and blocks when there has been nothing to write for a while.
+// All files of one writer must be written from the same thread.
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ivanp/error.hh"
+
+#include "lockfree_queue.hh"
+
+class async_writer {
+  struct job {
+    int fd;
+    std::vector<char> buf;
+  };
+
+  const size_t buf_size;
+  spsc_queue<job> pending;
+  spsc_queue<std::vector<char>> free_bufs;
+  std::atomic<size_t> nsubmitted { 0 }, ncompleted { 0 };
+  std::atomic<int> error { 0 };
+  std::atomic<bool> stop { false };
+  std::atomic<bool> sleeping { false };
+  std::mutex m;
+  std::condition_variable cv;
+  std::thread thread;
+
+  // Wake the I/O thread if it is blocked
+  // The fences make sure that either the I/O thread sees the queue
+  // that was just pushed to or stop, or the caller sees it sleeping
+  void wake() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!sleeping.load(std::memory_order_relaxed)) return;
+    std::lock_guard<std::mutex> lock(m);
+    cv.notify_one();
+  }
+
+  void run() {
+    job j;
+    for (queue_backoff wait;;) {
+      if (!pending.pop(j)) {
+        if (stop.load(std::memory_order_acquire) && pending.empty()) break;
+        if (!wait.idle()) {
+          wait();
+          continue;
+        }
+        std::unique_lock<std::mutex> lock(m);
+        sleeping.store(true,std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cv.wait(lock,[this]{
+          return !pending.empty() || stop.load(std::memory_order_acquire);
+        });
+        sleeping.store(false,std::memory_order_relaxed);
+        wait.reset();
+        continue;
+      }
+      wait.reset();
+      for (size_t pos = 0; pos < j.buf.size(); ) {
+        const ssize_t n = ::write(j.fd,j.buf.data()+pos,j.buf.size()-pos);
+        if (n < 0) {
+          if (errno==EINTR) continue;
+          error = errno;
+          break;
+        }
+        pos += n;
+      }
+      j.buf.clear();
+      free_bufs.push(std::move(j.buf)); // dropped if the pool is full
+      ncompleted.fetch_add(1,std::memory_order_release);
+    }
+  }
+
+  std::vector<char> get_buffer() {
+    std::vector<char> buf;
+    if (!free_bufs.pop(buf)) buf.reserve(buf_size);
+    return buf;
+  }
+
+  void submit(int fd, std::vector<char>& buf) {
+    check();
+    job j { fd, std::move(buf) };
+    for (queue_backoff wait; !pending.push(std::move(j)); ) wait();
+    wake();
+    ++nsubmitted;
+    buf = get_buffer();
+  }
+
+  void check() const {
+    if (error) throw ivanp::error("async_writer: ",std::strerror(error));
+  }
+
+public:
+  class file {
+    async_writer* w = nullptr;
+    int fd = -1;
+    std::vector<char> buf;
+    size_t pos = 0; // bytes written
+
+  public:
+    file() = default;
+    file(file&& o) noexcept
+    : w(o.w), fd(o.fd), buf(std::move(o.buf)), pos(o.pos) {
+      o.fd = -1;
+    }
+    file(const file&) = delete;
+    file& operator=(const file&) = delete;
+    ~file() { // errors are only reported by an explicit close()
+      try { close(); } catch (...) { }
+    }
+
+    void open(async_writer& writer, const std::string& name) {
+      close();
+      fd = ::open(name.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
+      if (fd < 0) throw ivanp::error("cannot open ",name);
+      w = &writer;
+      buf = w->get_buffer();
+      pos = 0;
+    }
+
+    // Continue writing an existing file,
+    // discarding everything after the first size bytes
+    void open_at(async_writer& writer, const std::string& name, size_t size) {
+      close();
+      fd = ::open(name.c_str(),O_WRONLY);
+      if (fd < 0) throw ivanp::error("cannot open ",name);
+      if (::ftruncate(fd,size) || ::lseek(fd,size,SEEK_SET) < 0) {
+        ::close(fd);
+        fd = -1;
+        throw ivanp::error("cannot truncate ",name);
+      }
+      w = &writer;
+      buf = w->get_buffer();
+      pos = size;
+    }
+
+    size_t size() const noexcept { return pos; }
+
+    inline void write(const void* p, size_t n) {
+      const char* c = static_cast<const char*>(p);
+      pos += n;
+      if (buf.size() + n > w->buf_size) {
+        if (!buf.empty()) w->submit(fd,buf);
+        if (n > w->buf_size) { // larger than a buffer, hand over as is
+          std::vector<char> big(c,c+n);
+          w->submit(fd,big);
+          return;
+        }
+      }
+      buf.insert(buf.end(),c,c+n);
+    }
+
+    // Hand the current buffer to the I/O thread
+    void flush() {
+      if (fd >= 0 && !buf.empty()) w->submit(fd,buf);
+    }
+
+    // Write everything and make sure it reached the disk
+    void sync() {
+      if (fd < 0) return;
+      flush();
+      w->wait();
+      if (::fsync(fd)) throw ivanp::error("fsync failed");
+    }
+
+    void close() {
+      if (fd < 0) return;
+      flush();
+      w->wait();
+      ::close(fd);
+      fd = -1;
+    }
+  };
+
+  explicit async_writer(size_t buf_size = 1 << 20, size_t queue_size = 64)
+  : buf_size(buf_size), pending(queue_size), free_bufs(queue_size),
+    thread(&async_writer::run,this) { }
+
+  ~async_writer() {
+    stop.store(true,std::memory_order_release);
+    wake();
+    thread.join();
+  }
+
+  async_writer(const async_writer&) = delete;
+  async_writer& operator=(const async_writer&) = delete;
+
+  // Block until every submitted buffer is written
+  void wait() {
+    for (queue_backoff wait;
+         ncompleted.load(std::memory_order_acquire) != nsubmitted; ) wait();
+    check();
+  }
+};
+
+#endif
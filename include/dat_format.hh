@@ -0,0 +1,279 @@
+#ifndef DAT_FORMAT_HH
+#define DAT_FORMAT_HH
+
+// Binary container for the events of one mass bin
+//
+// Layout:
+//   header
+//   fields   char[nfields][16]  names of the record fields, all float64
+//   info     JSON metadata, header.info_size bytes
+//   padding  to a multiple of 8 bytes
+//   records  float64[nevents][nfields]
+//   index    float64[ceil(nevents/index_stride)], only if sorted
+//   footer
+// header.nevents is written when the file is closed,
+// so a file that was not closed fails validation
+// The first field is the event weight
+//
+// Records may be sorted by one of the fields, header.sort_field-1
+// The index then holds the value of that field for every
+// index_stride-th record, so that a range of values can be found
+// without touching most of the records
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <limits>
+#include <utility>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ivanp/error.hh"
+
+#include "async_writer.hh"
+
+struct dat_header {
+  char magic[8];
+  std::uint32_t version, nfields;
+  std::uint64_t info_size, nevents;
+  std::uint32_t sort_field, index_stride;
+  char reserved[24];
+};
+static_assert(sizeof(dat_header)==64,"");
+
+using dat_field = char[16];
+
+struct dat_footer {
+  std::uint64_t nevents;
+  double sumw, sumw2, x_min, x_max; // x is field 1
+  char reserved[16];
+  char magic[8];
+};
+static_assert(sizeof(dat_footer)==64,"");
+
+constexpr char dat_magic[8] = "ttphDAT";
+constexpr std::uint32_t dat_version = 1;
+
+inline std::uint64_t dat_records_offset(
+  std::uint64_t nfields, std::uint64_t info_size
+) noexcept {
+  const std::uint64_t n =
+    sizeof(dat_header) + nfields*sizeof(dat_field) + info_size;
+  return (n + 7) & ~std::uint64_t(7);
+}
+
+class dat_writer {
+  async_writer::file f;
+  std::string name;
+  dat_header h;
+  dat_footer footer;
+  std::vector<double> index;
+
+  void init(
+    const std::string& info, const std::vector<std::string>& fields,
+    unsigned sort_field, unsigned index_stride
+  ) {
+    if (fields.size() < 2 || fields[0]!="weight")
+      throw ivanp::error("dat records must start with weight");
+    h = { };
+    std::memcpy(h.magic,dat_magic,sizeof(h.magic));
+    h.version = dat_version;
+    h.nfields = fields.size();
+    h.info_size = info.size();
+    h.sort_field = sort_field;
+    h.index_stride = sort_field ? index_stride : 0;
+
+    footer = { };
+    std::memcpy(footer.magic,dat_magic,sizeof(footer.magic));
+    footer.x_min =  std::numeric_limits<double>::infinity();
+    footer.x_max = -std::numeric_limits<double>::infinity();
+    index.clear();
+  }
+
+public:
+  // What is needed to continue writing a file after a restart
+  struct state {
+    std::uint64_t size; // bytes
+    dat_footer footer;
+  };
+
+  // Field sort_field-1 is indexed, if sort_field is not 0
+  // Records must then be written in order of that field
+  void open(
+    async_writer& w, const std::string& name, const std::string& info,
+    const std::vector<std::string>& fields,
+    unsigned sort_field = 0, unsigned index_stride = 1024
+  ) {
+    init(info,fields,sort_field,index_stride);
+    this->name = name;
+    f.open(w,name);
+
+    f.write(&h,sizeof(h));
+    for (const auto& field : fields) {
+      if (field.size() >= sizeof(dat_field))
+        throw ivanp::error("dat field name \"",field,"\" is too long");
+      dat_field buf { };
+      std::strncpy(buf,field.c_str(),sizeof(buf)-1);
+      f.write(buf,sizeof(buf));
+    }
+    f.write(info.data(),info.size());
+    const char pad[8] { };
+    f.write(pad,dat_records_offset(h.nfields,h.info_size)
+      - (sizeof(h) + h.nfields*sizeof(dat_field) + h.info_size));
+  }
+
+  // Write out everything so far and return the state of the file
+  state checkpoint() {
+    f.sync();
+    return { f.size(), footer };
+  }
+
+  // Continue a file opened with the same arguments,
+  // from the state returned by checkpoint()
+  // Sorted files cannot be continued
+  void resume(
+    async_writer& w, const std::string& name, const std::string& info,
+    const std::vector<std::string>& fields, const state& st
+  ) {
+    init(info,fields,0,0);
+    this->name = name;
+    if (st.size < dat_records_offset(h.nfields,h.info_size)
+        + st.footer.nevents*h.nfields*sizeof(double))
+      throw ivanp::error("cannot resume ",name);
+    f.open_at(w,name,st.size);
+    footer = st.footer;
+  }
+
+  unsigned nfields() const noexcept { return h.nfields; }
+  std::uint64_t nevents() const noexcept { return footer.nevents; }
+
+  // Write a record of nfields() values
+  inline void operator()(const double* r) {
+    if (h.sort_field && !(footer.nevents % h.index_stride))
+      index.push_back(r[h.sort_field-1]);
+    f.write(r,h.nfields*sizeof(double));
+    ++footer.nevents;
+    footer.sumw  += r[0];
+    footer.sumw2 += r[0]*r[0];
+    if (r[1] < footer.x_min) footer.x_min = r[1];
+    if (r[1] > footer.x_max) footer.x_max = r[1];
+  }
+
+  // Write the index, the footer, and the event count in the header
+  void close() {
+    f.write(index.data(),index.size()*sizeof(double));
+    f.write(&footer,sizeof(footer));
+    f.close();
+    const int fd = ::open(name.c_str(),O_WRONLY);
+    if (fd < 0) throw ivanp::error("cannot open ",name);
+    const bool ok = ::pwrite(fd,&footer.nevents,sizeof(footer.nevents),
+      offsetof(dat_header,nevents)) == sizeof(footer.nevents);
+    ::close(fd);
+    if (!ok) throw ivanp::error("cannot write ",name);
+  }
+};
+
+// Read-only memory map of a dat file
+class dat_file {
+  void* data = MAP_FAILED;
+  size_t size = 0;
+  const dat_header* h;
+  const dat_footer* ft;
+  const double* recs;
+  const double* index;
+  std::uint64_t index_size;
+
+public:
+  dat_file(const std::string& path) {
+    const int fd = ::open(path.c_str(),O_RDONLY);
+    if (fd < 0) throw ivanp::error("cannot open ",path);
+    struct stat st;
+    if (::fstat(fd,&st)) {
+      ::close(fd);
+      throw ivanp::error("cannot stat ",path);
+    }
+    size = st.st_size;
+    if (size >= sizeof(dat_header)+sizeof(dat_footer))
+      data = ::mmap(nullptr,size,PROT_READ,MAP_SHARED,fd,0);
+    ::close(fd);
+    if (data==MAP_FAILED) throw ivanp::error("cannot map ",path);
+    ::madvise(data,size,MADV_SEQUENTIAL);
+
+    h = static_cast<const dat_header*>(data);
+    if (std::memcmp(h->magic,dat_magic,sizeof(h->magic)) ||
+        h->version!=dat_version || h->nfields < 2 ||
+        h->sort_field > h->nfields || (h->sort_field && !h->index_stride))
+      throw ivanp::error(path," is not a dat file");
+
+    index_size = h->sort_field
+      ? (h->nevents + h->index_stride - 1)/h->index_stride : 0;
+    const std::uint64_t pos = dat_records_offset(h->nfields,h->info_size);
+    if (pos + (h->nevents*h->nfields + index_size)*sizeof(double)
+        + sizeof(dat_footer) != size)
+      throw ivanp::error(path," has wrong size");
+    recs = reinterpret_cast<const double*>(
+      static_cast<const char*>(data) + pos);
+    index = recs + h->nevents*h->nfields;
+    ft = reinterpret_cast<const dat_footer*>(
+      static_cast<const char*>(data) + size) - 1;
+    if (std::memcmp(ft->magic,dat_magic,sizeof(ft->magic)) ||
+        ft->nevents!=h->nevents)
+      throw ivanp::error(path," has a corrupt footer");
+  }
+  ~dat_file() { if (data!=MAP_FAILED) ::munmap(data,size); }
+
+  dat_file(const dat_file&) = delete;
+  dat_file& operator=(const dat_file&) = delete;
+
+  std::string info() const {
+    return {
+      reinterpret_cast<const char*>(h+1) + h->nfields*sizeof(dat_field),
+      size_t(h->info_size) };
+  }
+  std::vector<std::string> fields() const {
+    const dat_field* fs = reinterpret_cast<const dat_field*>(h+1);
+    return { fs, fs + h->nfields };
+  }
+  std::uint64_t nevents() const noexcept { return h->nevents; }
+  unsigned nfields() const noexcept { return h->nfields; }
+  const dat_footer& footer() const noexcept { return *ft; }
+
+  // Record i is [records()+i*nfields(), records()+(i+1)*nfields())
+  const double* records() const noexcept { return recs; }
+
+  // Index of the field the records are sorted by, or -1
+  int sort_field() const noexcept { return int(h->sort_field) - 1; }
+  unsigned index_stride() const noexcept { return h->index_stride; }
+
+  // Range of records [first,last) with lo <= value < hi
+  // of the field the records are sorted by
+  std::pair<std::uint64_t,std::uint64_t> select(double lo, double hi) const {
+    if (!h->sort_field) throw ivanp::error("dat file is not sorted");
+    const unsigned field = h->sort_field - 1, stride = h->index_stride;
+    // first record with value >= x
+    auto lower_bound = [&](double x) -> std::uint64_t {
+      // index entries are values of records 0, stride, 2*stride, ...
+      const std::uint64_t k = std::lower_bound(index,index+index_size,x)
+                            - index;
+      std::uint64_t a = k ? (k-1)*stride : 0;
+      std::uint64_t b = std::min<std::uint64_t>(k*stride,h->nevents);
+      while (a < b) {
+        const std::uint64_t m = a + (b-a)/2;
+        if (recs[m*h->nfields + field] < x) a = m+1;
+        else b = m;
+      }
+      return a;
+    };
+    const auto first = lower_bound(lo);
+    return { first, std::max(first,lower_bound(hi)) };
+  }
+};
+
+#endif
@@ -1,8 +1,127 @@
 #ifndef EVENT_HH
 #define EVENT_HH
 
-struct {
-  double weight, cos_theta;
-} event;
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include "dat_format.hh"
+#include "Legendre.hh"
+
+// Consecutive events, w[i*stride] and x[i*stride] for i in [0,n)
+// They either point into the mapped records of a dat file,
+// with a stride of the number of fields, or into ws and xs
+struct event_segment {
+  const double *w = nullptr, *x = nullptr;
+  size_t n = 0;
+  unsigned stride = 1;
+  std::vector<double> ws, xs; // only if the events were copied
+
+  event_segment() = default;
+  event_segment(event_segment&&) = default;
+  event_segment& operator=(event_segment&&) = default;
+};
+
+// Records [first,last) of f, with x from column col
+// Events with |x| > range or NaN x are dropped and x is divided by range
+// If nothing has to be dropped or scaled, the records are used in place,
+// otherwise the events are copied in a single pass
+inline event_segment select_events(
+  const dat_file& f, std::uint64_t first, std::uint64_t last,
+  unsigned col, double range
+) {
+  const unsigned nf = f.nfields();
+  const double* const recs = f.records() + first*nf;
+  const size_t n = last - first;
+  event_segment s;
+
+  // NaN is out of range, so events with NaN x are dropped on both paths
+  // The footer has the range of field 1 for the whole file,
+  // but it skips NaN, so it can only tell that x is out of range
+  bool in_range = (range==1 && !(col==1 &&
+    (f.footer().x_min < -range || range < f.footer().x_max)));
+  for (size_t i=0; in_range && i<n; ++i)
+    in_range = (std::abs(recs[i*nf+col]) <= range);
+  if (in_range) {
+    s.w = recs;
+    s.x = recs + col;
+    s.n = n;
+    s.stride = nf;
+    return s;
+  }
+
+  // every event is stored, but the position only advances
+  // for those that pass, so that the loop has no branches
+  s.ws.resize(n);
+  s.xs.resize(n);
+  double *w = s.ws.data(), *x = s.xs.data();
+  size_t k = 0;
+  for (size_t i=0; i<n; ++i) {
+    const double* r = recs + i*nf;
+    w[k] = r[0];
+    x[k] = r[col]/range;
+    k += (std::abs(r[col]) <= range);
+  }
+  s.ws.resize(k);
+  s.xs.resize(k);
+  s.w = s.ws.data();
+  s.x = s.xs.data();
+  s.n = k;
+  return s;
+}
+
+// Weights and Legendre polynomials of events, as arrays
+struct event_basis {
+  std::vector<double> w, p2, p4, p6;
+  size_t size() const noexcept { return w.size(); }
+};
+
+// All events to fit, as segments in the order of the input files
+class event_store {
+  std::vector<event_segment> segs;
+  size_t nevents = 0;
+  event_basis _basis;
+
+public:
+  void add(event_segment&& s) {
+    if (!s.n) return;
+    nevents += s.n;
+    segs.push_back(std::move(s));
+  }
+
+  size_t size() const noexcept { return nevents; }
+  const std::vector<event_segment>& segments() const noexcept {
+    return segs;
+  }
+
+  // Compute the Legendre polynomials of every event once,
+  // since the events do not change during a fit
+  void cache_basis() {
+    auto& b = _basis;
+    b.w.resize(nevents);
+    b.p2.resize(nevents);
+    b.p4.resize(nevents);
+    b.p6.resize(nevents);
+    size_t offset = 0;
+    for (const auto& s : segs) {
+      double *w = b.w.data() + offset,
+             *p2 = b.p2.data() + offset,
+             *p4 = b.p4.data() + offset,
+             *p6 = b.p6.data() + offset;
+      const double *sw = s.w, *sx = s.x;
+      const size_t n = s.n, stride = s.stride;
+      #pragma omp parallel for
+      for (size_t i=0; i<n; ++i) {
+        w[i] = sw[i*stride];
+        Legendre_basis(sx[i*stride],p2[i],p4[i],p6[i]);
+      }
+      offset += n;
+    }
+  }
+  bool has_basis() const noexcept { return _basis.size(); }
+  const event_basis& basis() const noexcept { return _basis; }
+};
 
 #endif
@@ -1,6 +1,8 @@
 #ifndef IVANP_FLOAT_OR_DOUBLE_READER_HH
 #define IVANP_FLOAT_OR_DOUBLE_READER_HH
 
+#include <initializer_list>
+
 #include <TLeaf.h>
 #include "ivanp/error.hh"
 
@@ -11,6 +13,27 @@ bool branch_is_double(TTree* t, const char* branchname) {
   else throw ivanp::error("The type of branch ",branchname," is ",branchtype);
 }
 
+// All listed branches must have the same floating point type
+bool branches_are_double(
+  TTree* t, std::initializer_list<const char*> branchnames
+) {
+  const bool is_double = branch_is_double(t,*branchnames.begin());
+  for (const char* branchname : branchnames)
+    if (branch_is_double(t,branchname)!=is_double)
+      throw ivanp::error("Branches ",*branchnames.begin()," and ",branchname,
+                         " have different types");
+  return is_double;
+}
+
+// Call f with a value of the branch type, so that the code using
+// the branch is instantiated for either Float_t or Double_t
+// and the type is not tested on every access
+template <typename F>
+inline void float_or_double(bool is_double, F&& f) {
+  if (is_double) f(Double_t{});
+  else f(Float_t{});
+}
+
 class float_or_double_value_reader {
 public:
   using double_reader_type = TTreeReaderValue<Double_t>;
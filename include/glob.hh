@@ -8,6 +8,17 @@ namespace ivanp {
 
 std::vector<std::string> glob(const std::string& pattern);
 
+// Expand the outermost {a,b,...} alternatives of the pattern
+// Unbalanced braces and braces without a comma are left as is
+std::vector<std::string> expand_braces(const std::string& pattern);
+
+// Glob several patterns concurrently
+// Braces are expanded first, so that each alternative is globbed
+// separately, which matters on slow filesystems
+// Returns the matches of each pattern, in the same order as a serial glob
+std::vector<std::vector<std::string>> glob(
+  const std::vector<std::string>& patterns, unsigned nthreads);
+
 }
 
 #endif
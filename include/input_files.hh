@@ -0,0 +1,130 @@
+#ifndef INPUT_FILES_HH
+#define INPUT_FILES_HH
+
+// Discovery of the input ntuples before the event loop
+// Files are stat'ed and their entry counts read concurrently,
+// so that the chain does not have to open them one by one
+// Entry counts are cached on disk, keyed by path, size and mtime,
+// so files that did not change are not opened at all
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <numeric>
+#include <algorithm>
+
+#include <sys/stat.h>
+
+#include <TROOT.h>
+#include <TFile.h>
+#include <TTree.h>
+
+#include "json.hpp"
+
+#include "ivanp/error.hh"
+
+#include "parallel_for.hh"
+#include "write_file.hh"
+
+struct input_file {
+  std::string path;
+  std::int64_t size = 0, mtime = 0;
+  Long64_t entries = -1; // -1 if not known yet
+};
+
+class entries_cache {
+  std::string name; // empty if not stored on disk
+  std::string tree;
+  std::map<std::string,input_file> files;
+  bool changed = false;
+
+public:
+  entries_cache(const char* name, const char* tree)
+  : name(name ? name : ""), tree(tree) {
+    if (!name) return;
+    std::ifstream f(name);
+    if (!f) return;
+    nlohmann::json j;
+    f >> j;
+    if (j.at("tree")!=tree) return;
+    for (const auto& jf : j.at("files")) {
+      input_file file { jf.at("path"), jf.at("size"), jf.at("mtime"),
+                        jf.at("entries") };
+      files[file.path] = file;
+    }
+  }
+
+  // Set the entries of the file if they are known for its size and mtime
+  bool get(input_file& file) const {
+    const auto it = files.find(file.path);
+    if (it==files.end()) return false;
+    const auto& f = it->second;
+    if (f.size!=file.size || f.mtime!=file.mtime) return false;
+    file.entries = f.entries;
+    return true;
+  }
+  void set(const input_file& file) {
+    files[file.path] = file;
+    changed = true;
+  }
+
+  void save() const {
+    if (name.empty() || !changed) return;
+    nlohmann::json j { {"tree",tree}, {"files",nlohmann::json::array()} };
+    for (const auto& p : files) {
+      const auto& f = p.second;
+      j["files"].push_back({
+        {"path",f.path}, {"size",f.size}, {"mtime",f.mtime},
+        {"entries",f.entries} });
+    }
+    write_file(name,j.dump(1)+'\n');
+  }
+};
+
+// Stat all files concurrently
+inline std::vector<input_file> stat_inputs(
+  const std::vector<std::string>& names, unsigned nthreads
+) {
+  std::vector<input_file> files(names.size());
+  parallel_for(names.size(),nthreads,[&](unsigned i){
+    auto& f = files[i];
+    f.path = names[i];
+    struct stat st;
+    if (::stat(f.path.c_str(),&st)) throw ivanp::error("cannot stat ",f.path);
+    f.size = st.st_size;
+    f.mtime = st.st_mtime;
+  });
+  return files;
+}
+
+// Fill entries of the files that are not in the cache
+// Files are opened concurrently, largest first, so that the biggest
+// ones do not end up last and leave the other threads idle
+inline void count_entries(
+  std::vector<input_file>& files, const char* tree_name,
+  entries_cache& cache, unsigned nthreads
+) {
+  std::vector<unsigned> todo;
+  for (unsigned i=0; i<files.size(); ++i)
+    if (files[i].entries < 0 && !cache.get(files[i])) todo.push_back(i);
+  if (todo.empty()) return;
+  std::stable_sort(todo.begin(),todo.end(),[&](unsigned a, unsigned b){
+    return files[a].size > files[b].size;
+  });
+
+  if (nthreads > 1) ROOT::EnableThreadSafety();
+  parallel_for(todo.size(),nthreads,[&](unsigned i){
+    auto& f = files[todo[i]];
+    TFile file(f.path.c_str());
+    if (file.IsZombie()) throw ivanp::error("cannot open file ",f.path);
+    TTree* tree = nullptr;
+    file.GetObject(tree_name,tree);
+    if (!tree) throw ivanp::error("no tree ",tree_name," in ",f.path);
+    f.entries = tree->GetEntries();
+  });
+  for (unsigned i : todo) cache.set(files[i]);
+}
+
+#endif
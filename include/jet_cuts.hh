@@ -0,0 +1,86 @@
+#ifndef JET_CUTS_HH
+#define JET_CUTS_HH
+
+#include <vector>
+#include <string>
+#include <cmath>
+#include <limits>
+
+#include "ivanp/error.hh"
+
+// Jet four-momenta stored as structure of arrays
+struct jet_soa {
+  std::vector<double> px, py, pz, E, key;
+
+  unsigned size() const noexcept { return px.size(); }
+  void clear() { px.clear(); py.clear(); pz.clear(); E.clear(); }
+  void push_back(double x, double y, double z, double t) {
+    px.push_back(x); py.push_back(y); pz.push_back(z); E.push_back(t);
+  }
+};
+
+// Jet cuts compiled into a fixed set of thresholds
+// Every cut is written as a comparison of squared quantities, so that
+// all of them are evaluated in one branchless loop without sqrt or log
+// A cut that is not set is a comparison that every jet passes
+//
+// To add a cut: add its threshold here, parse it in set(),
+// and add its comparison to the loop in leading()
+class jet_cuts {
+  static constexpr double inf = std::numeric_limits<double>::infinity();
+
+  double pt2_min = -inf;  // pt   >= val : pt2 >= val^2
+  double eta_c   = 0;     // |eta| <= val : pz2/sinh(val)^2 <= pt2
+  double y_c     = 0;     // |y|   <= val : pz2/tanh(val)^2 <= E2
+  double x_c = 0, x_lo = -inf; // m/(R pt) >= val : m2 >= (val R)^2 pt2
+  double m2_min  = -inf;  // m    >= val : m2 >= val^2
+
+public:
+  void set(const std::string& var, double val, double R) {
+    if (var=="pt") pt2_min = val*val;
+    else if (var=="eta") eta_c = 1./std::pow(std::sinh(val),2);
+    else if (var=="y") y_c = 1./std::pow(std::tanh(val),2);
+    else if (var=="x") {
+      if (!(val > 0)) throw ivanp::error("jet x cut must be positive");
+      if (!(R > 0)) throw ivanp::error("jet x cut requires a jet algorithm");
+      x_c = std::pow(val*R,2);
+      x_lo = 0;
+    }
+    else if (var=="m") m2_min = val*val;
+    else throw ivanp::error("unknown jet cut \"",var,'\"');
+  }
+
+  // Index of the highest pT jet passing the cuts, or -1 if none pass
+  // jets.key is used as scratch space
+  int leading(jet_soa& jets) const {
+    const unsigned n = jets.size();
+    jets.key.resize(n);
+    const double * __restrict px = jets.px.data();
+    const double * __restrict py = jets.py.data();
+    const double * __restrict pz = jets.pz.data();
+    const double * __restrict E  = jets.E .data();
+    double * __restrict key = jets.key.data();
+
+    for (unsigned i=0; i<n; ++i) {
+      const double pt2 = px[i]*px[i] + py[i]*py[i];
+      const double pz2 = pz[i]*pz[i];
+      const double E2  = E[i]*E[i];
+      const double m2  = E2 - pz2 - pt2;
+      const bool pass =
+        (pt2 >= pt2_min) &
+        (pz2*eta_c <= pt2) &
+        (pz2*y_c <= E2) &
+        (m2 >= x_c*pt2 + x_lo) &
+        (m2 >= m2_min);
+      key[i] = pass ? pt2 : -1.;
+    }
+
+    int lead = -1;
+    double max = -1.;
+    for (unsigned i=0; i<n; ++i)
+      if (key[i] > max) { max = key[i]; lead = i; }
+    return lead;
+  }
+};
+
+#endif
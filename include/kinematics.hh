@@ -0,0 +1,58 @@
+#ifndef KINEMATICS_HH
+#define KINEMATICS_HH
+
+#include <vector>
+#include <string>
+
+// Observables of the Higgs + jet system
+// Every cosθ is (ell.Z)/sqrt(ell^2 Z^2), where ell is the Higgs momentum
+// in the rest frame of the system, Q = H + j, and Z is the frame axis:
+//   cos_theta      Collins-Soper,     Z = (0,0,E_Q,pz_Q)
+//   cos_theta_hel  helicity,          Z = (E_Q/Q^2) Q - T
+//   cos_theta_GJ   Gottfried-Jackson, Z = P1 - (Q.P1/Q^2) Q
+// with beams P1 = (0,0,1,1), P2 = (0,0,-1,1) and lab time T = (0,0,0,1)
+// cos_theta already is the Collins-Soper angle, since the usual axis
+// P1/(Q.P1) - P2/(Q.P2) is proportional to (0,0,E_Q,pz_Q),
+// so cos_theta_CS is accepted as another name for it
+enum class observable {
+  cos_theta, cos_theta_hel, cos_theta_GJ,
+  pT, y, M
+};
+
+observable observable_from_name(const std::string& name);
+const char* observable_name(observable obs) noexcept;
+
+// Higgs and leading jet four-momenta of a block of events,
+// stored as structure of arrays, and the observables computed from them
+struct pair_block {
+  std::vector<double> Hx, Hy, Hz, HE; // Higgs
+  std::vector<double> jx, jy, jz, jE; // jet
+  std::vector<double> weight;
+
+  // filled by higgs_jet_kinematics
+  std::vector<double> mass;
+  std::vector<std::vector<double>> obs; // one column per observable
+  std::vector<double> Qx, Qy, Qz, QE, Q2, lz, lE, l2; // scratch
+
+  unsigned size() const noexcept { return weight.size(); }
+  void clear() {
+    Hx.clear(); Hy.clear(); Hz.clear(); HE.clear();
+    jx.clear(); jy.clear(); jz.clear(); jE.clear();
+    weight.clear();
+  }
+  template <typename H, typename J>
+  void push_back(const H& higgs, const J& jet, double w) {
+    Hx.push_back(higgs[0]); Hy.push_back(higgs[1]);
+    Hz.push_back(higgs[2]); HE.push_back(higgs[3]);
+    jx.push_back(jet[0]); jy.push_back(jet[1]);
+    jz.push_back(jet[2]); jE.push_back(jet[3]);
+    weight.push_back(w);
+  }
+};
+
+// Compute the Higgs + jet invariant mass and
+// the requested observables for every pair in the block
+void higgs_jet_kinematics(
+  pair_block& pairs, const std::vector<observable>& obs);
+
+#endif
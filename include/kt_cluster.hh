@@ -0,0 +1,112 @@
+#ifndef KT_CLUSTER_HH
+#define KT_CLUSTER_HH
+
+// Generalized kt clustering for events with few particles,
+// for which setting up a fastjet::ClusterSequence costs more
+// than the clustering itself
+// Distances, rapidity and phi are defined as in FastJet,
+// with E-scheme recombination
+
+#include <cmath>
+#include <algorithm>
+
+#include <fastjet/JetDefinition.hh>
+
+#include "ivanp/error.hh"
+#include "jet_cuts.hh"
+
+class kt_clusterer {
+public:
+  static constexpr unsigned max_n = 16;
+
+private:
+  struct pseudojet {
+    double px, py, pz, E, kt2, rap, phi, scale;
+  };
+  pseudojet jets[max_n];
+  int p; // power of kt: 1 - kt, 0 - C/A, -1 - anti-kt
+  double R2;
+
+  void set(pseudojet& j) const noexcept {
+    constexpr double twopi = 2*M_PI;
+    j.kt2 = j.px*j.px + j.py*j.py;
+    j.phi = (j.kt2 == 0.) ? 0. : std::atan2(j.py,j.px);
+    if (j.phi < 0.) j.phi += twopi;
+    if (j.phi >= twopi) j.phi -= twopi;
+    if (j.E == std::abs(j.pz) && j.kt2 == 0.) {
+      const double max_rap = 1e5 + std::abs(j.pz);
+      j.rap = (j.pz >= 0.) ? max_rap : -max_rap;
+    } else {
+      const double m2 = std::max(0.,(j.E+j.pz)*(j.E-j.pz) - j.kt2);
+      const double E_plus_pz = j.E + std::abs(j.pz);
+      j.rap = 0.5*std::log((j.kt2 + m2)/(E_plus_pz*E_plus_pz));
+      if (j.pz > 0.) j.rap = -j.rap;
+    }
+    switch (p) {
+      case  1: j.scale = j.kt2; break;
+      case  0: j.scale = 1.; break;
+      default: j.scale = (j.kt2 > 1e-300) ? 1./j.kt2 : 1e300;
+    }
+  }
+
+  static double dR2(const pseudojet& a, const pseudojet& b) noexcept {
+    double dphi = std::abs(a.phi - b.phi);
+    if (dphi > M_PI) dphi = 2*M_PI - dphi;
+    const double drap = a.rap - b.rap;
+    return dphi*dphi + drap*drap;
+  }
+
+public:
+  kt_clusterer(const fastjet::JetDefinition& def): R2(def.R()*def.R()) {
+    switch (def.jet_algorithm()) {
+      case fastjet::kt_algorithm: p = 1; break;
+      case fastjet::cambridge_algorithm: p = 0; break;
+      case fastjet::antikt_algorithm: p = -1; break;
+      default: throw ivanp::error("kt_clusterer: unsupported algorithm");
+    }
+  }
+
+  // Cluster particles [first,last) into inclusive jets
+  // Requires last-first <= max_n
+  // P is an array or a pointer
+  template <typename P, typename I>
+  void operator()(
+    const P& px, const P& py, const P& pz, const P& E,
+    I first, I last, jet_soa& out
+  ) {
+    unsigned n = 0;
+    for (I i=first; i<last; ++i, ++n) {
+      jets[n].px = px[i]; jets[n].py = py[i];
+      jets[n].pz = pz[i]; jets[n].E  = E [i];
+      set(jets[n]);
+    }
+
+    while (n) {
+      // smallest beam distance, preferred over pairs on a tie
+      unsigned a = 0, b = 0;
+      double dmin = jets[0].scale;
+      for (unsigned i=1; i<n; ++i)
+        if (jets[i].scale < dmin) dmin = jets[i].scale, a = i;
+      // smallest pair distance
+      for (unsigned i=1; i<n; ++i) {
+        for (unsigned j=0; j<i; ++j) {
+          const double d =
+            std::min(jets[i].scale,jets[j].scale)*dR2(jets[i],jets[j])/R2;
+          if (d < dmin) dmin = d, a = i, b = j + 1;
+        }
+      }
+
+      if (b) { // merge a and b-1
+        pseudojet& j = jets[b-1];
+        j.px += jets[a].px; j.py += jets[a].py;
+        j.pz += jets[a].pz; j.E  += jets[a].E;
+        set(j);
+      } else { // a is a final jet
+        out.push_back(jets[a].px,jets[a].py,jets[a].pz,jets[a].E);
+      }
+      jets[a] = jets[--n];
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef LIKELIHOOD_HH
+#define LIKELIHOOD_HH
+
+#include <cstddef>
+
+// |c0 + c2 e^(i phi) P2 + c4 P4 + c6 P6|^2 in real arithmetic,
+//   (c0 + c2 cos(phi) P2 + c4 P4 + c6 P6)^2 + (c2 sin(phi) P2)^2
+// with c0 fixed by the normalization, as in Legendre.hh
+struct legendre_coefs {
+  double c0, c2r, c2i, c4, c6;
+  double c2, cos_phi, sin_phi;
+  double dc0[3]; // derivatives of c0 with respect to c2, c4, c6
+  legendre_coefs(const double* c); // c2, c4, c6, phi2
+};
+
+// f[i] for i in [0,n), from precomputed P2, P4, P6
+void legendre_kernel(
+  const legendre_coefs& k, size_t n,
+  const double* p2, const double* p4, const double* p6, double* f);
+
+// Sum of w[i]*log(f[i]) for i in [0,n)
+double legendre_logl(
+  const legendre_coefs& k, size_t n, const double* w,
+  const double* p2, const double* p4, const double* p6);
+
+// Same, and adds the derivatives of the sum
+// with respect to c2, c4, c6, phi2 to grad
+double legendre_logl(
+  const legendre_coefs& k, size_t n, const double* w,
+  const double* p2, const double* p4, const double* p6, double* grad);
+
+// Same for events w[i*stride] and x[i*stride] for i in [0,n),
+// as in the dat records, with P2, P4, P6 of x computed on the fly
+// The gradient is only computed if grad is not null
+double legendre_logl(
+  const legendre_coefs& k, size_t n, unsigned stride,
+  const double* w, const double* x, double* grad);
+
+#endif
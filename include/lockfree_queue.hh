@@ -0,0 +1,135 @@
+#ifndef LOCKFREE_QUEUE_HH
+#define LOCKFREE_QUEUE_HH
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+
+// Queue capacities are powers of 2, so that positions wrap with a mask
+inline size_t queue_capacity(size_t n) noexcept {
+  size_t p = 1;
+  while (p < n) p <<= 1;
+  return p;
+}
+
+// Waiting for a queue: yield at first, then sleep for longer
+struct queue_backoff {
+  unsigned n = 0;
+  void operator()() {
+    if (n < 10) std::this_thread::yield();
+    else std::this_thread::sleep_for(std::chrono::microseconds(
+      n < 20 ? 50 : 1000));
+    ++n;
+  }
+  void reset() noexcept { n = 0; }
+  // Waited so long, about 10 ms at the longest sleep,
+  // that blocking would not cost the waiting thread anything
+  bool idle() const noexcept { return n >= 30; }
+};
+
+// Bounded single producer, single consumer queue
+// Capacity is rounded up to a power of 2
+template <typename T>
+class spsc_queue {
+  std::vector<T> slots;
+  const size_t mask;
+  alignas(64) std::atomic<size_t> head { 0 }; // next to pop
+  alignas(64) std::atomic<size_t> tail { 0 }; // next to push
+
+public:
+  explicit spsc_queue(size_t capacity)
+  : slots(queue_capacity(capacity)), mask(slots.size()-1) { }
+
+  // Called only by the producer
+  // Returns false if the queue is full
+  bool push(T&& x) {
+    const size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) > mask) return false;
+    slots[t & mask] = std::move(x);
+    tail.store(t+1,std::memory_order_release);
+    return true;
+  }
+
+  // Called only by the consumer
+  // Returns false if the queue is empty
+  bool pop(T& x) {
+    const size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) return false;
+    x = std::move(slots[h & mask]);
+    head.store(h+1,std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const noexcept {
+    return head.load(std::memory_order_acquire)
+        == tail.load(std::memory_order_acquire);
+  }
+};
+
+// Bounded multiple producer, multiple consumer queue
+// Every slot has a sequence number, telling whether it is ready
+// to be pushed to or popped from at the current position
+// Capacity is rounded up to a power of 2
+template <typename T>
+class mpmc_queue {
+  struct slot {
+    std::atomic<size_t> seq;
+    T value;
+  };
+  std::unique_ptr<slot[]> slots;
+  const size_t mask;
+  alignas(64) std::atomic<size_t> head { 0 }; // next to pop
+  alignas(64) std::atomic<size_t> tail { 0 }; // next to push
+
+public:
+  explicit mpmc_queue(size_t capacity)
+  : slots(new slot[queue_capacity(capacity)]),
+    mask(queue_capacity(capacity)-1)
+  {
+    for (size_t i=0; i<=mask; ++i)
+      slots[i].seq.store(i,std::memory_order_relaxed);
+  }
+
+  // Returns false if the queue is full
+  bool push(T&& x) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    for (;;) {
+      slot& s = slots[t & mask];
+      const auto d = std::intptr_t(s.seq.load(std::memory_order_acquire))
+                   - std::intptr_t(t);
+      if (d == 0) {
+        if (tail.compare_exchange_weak(t,t+1,std::memory_order_relaxed)) {
+          s.value = std::move(x);
+          s.seq.store(t+1,std::memory_order_release);
+          return true;
+        }
+      } else if (d < 0) return false;
+      else t = tail.load(std::memory_order_relaxed);
+    }
+  }
+
+  // Returns false if the queue is empty
+  bool pop(T& x) {
+    size_t h = head.load(std::memory_order_relaxed);
+    for (;;) {
+      slot& s = slots[h & mask];
+      const auto d = std::intptr_t(s.seq.load(std::memory_order_acquire))
+                   - std::intptr_t(h+1);
+      if (d == 0) {
+        if (head.compare_exchange_weak(h,h+1,std::memory_order_relaxed)) {
+          x = std::move(s.value);
+          s.seq.store(h+mask+1,std::memory_order_release);
+          return true;
+        }
+      } else if (d < 0) return false;
+      else h = head.load(std::memory_order_relaxed);
+    }
+  }
+};
+
+#endif
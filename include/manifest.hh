@@ -0,0 +1,64 @@
+#ifndef MANIFEST_HH
+#define MANIFEST_HH
+
+// Record of the input files that went into a set of vars outputs
+// A later run with the same config can reuse the records of input
+// files that did not change, instead of processing them again
+//
+// Every output holds the records of the input files in the order
+// of the files, so counts[i] records of output i, following those
+// of the previous files, came from a given file
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include "json.hpp"
+
+#include "write_file.hh"
+
+struct manifest {
+  struct file {
+    std::string path;
+    std::int64_t size, mtime, entries;
+    std::vector<std::int64_t> counts; // records in each output
+
+    bool same_input(const file& f) const noexcept {
+      return path==f.path && size==f.size && mtime==f.mtime;
+    }
+  };
+
+  nlohmann::json config; // everything the outputs depend on but the files
+  std::vector<std::string> outputs;
+  std::vector<file> files;
+
+  // Returns false if there is no manifest
+  bool load(const std::string& name) {
+    std::ifstream f(name);
+    if (!f) return false;
+    nlohmann::json j;
+    f >> j;
+    config = j.at("config");
+    outputs = j.at("outputs").get<std::vector<std::string>>();
+    files.clear();
+    for (const auto& jf : j.at("files"))
+      files.push_back({
+        jf.at("path"), jf.at("size"), jf.at("mtime"), jf.at("entries"),
+        jf.at("counts").get<std::vector<std::int64_t>>() });
+    return true;
+  }
+
+  void save(const std::string& name) const {
+    nlohmann::json j {
+      {"config",config}, {"outputs",outputs}, {"files",nlohmann::json::array()}
+    };
+    for (const auto& f : files)
+      j["files"].push_back({
+        {"path",f.path}, {"size",f.size}, {"mtime",f.mtime},
+        {"entries",f.entries}, {"counts",f.counts} });
+    write_file(name,j.dump(1)+'\n');
+  }
+};
+
+#endif
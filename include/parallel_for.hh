@@ -0,0 +1,37 @@
+#ifndef PARALLEL_FOR_HH
+#define PARALLEL_FOR_HH
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <algorithm>
+
+// Call f(i) for every i in [0,n) using up to nthreads threads
+// Indices are handed out in order, one at a time
+// The first exception thrown by f is rethrown after all threads finish
+template <typename F>
+void parallel_for(unsigned n, unsigned nthreads, F&& f) {
+  nthreads = std::max(1u,std::min(n,nthreads));
+  if (nthreads == 1) {
+    for (unsigned i=0; i<n; ++i) f(i);
+    return;
+  }
+  std::atomic<unsigned> next(0);
+  std::vector<std::exception_ptr> errors(nthreads);
+  std::vector<std::thread> threads;
+  threads.reserve(nthreads);
+  for (unsigned t=0; t<nthreads; ++t)
+    threads.emplace_back([&,t]{
+      try {
+        for (unsigned i; (i = next++) < n; ) f(i);
+      } catch (...) {
+        errors[t] = std::current_exception();
+        next = n; // stop the other threads
+      }
+    });
+  for (auto& thread : threads) thread.join();
+  for (auto& e : errors) if (e) std::rethrow_exception(e);
+}
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef PARTICLE_BLOCK_HH
+#define PARTICLE_BLOCK_HH
+
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <chrono>
+
+#include <TTree.h>
+#include <TBranch.h>
+#include <TFile.h>
+
+#include "ivanp/error.hh"
+
+// Particles of a block of events stored as structure of arrays
+// The Higgs is kept separately from the other particles
+template <typename T>
+struct particle_block {
+  // non-Higgs particles of event i are [offsets[i],offsets[i+1])
+  std::vector<T> px, py, pz, E;
+  std::vector<unsigned> offsets { 0 };
+  std::vector<std::array<T,4>> higgs;
+  std::vector<double> weight;
+
+  unsigned size() const noexcept { return weight.size(); }
+  void clear() {
+    px.clear(); py.clear(); pz.clear(); E.clear();
+    offsets.resize(1);
+    higgs.clear();
+    weight.clear();
+  }
+};
+
+// What a call of particle_block_reader took
+// Times are only measured if the reader is timed
+struct block_read_stats {
+  double t_read = 0;    // reading and decompressing branches, seconds
+  double t_extract = 0; // separating the Higgs and the other particles
+  Long64_t bytes = 0;   // read from the file
+};
+
+// Reads whole blocks of entries with TBranch::GetEntry,
+// bypassing the per element overhead of TTreeReaderArray
+// T and W are the types of the momentum and weight branches
+template <typename T, typename W>
+class particle_block_reader {
+  TTree* tree;
+  TBranch *b_np, *b_kf, *b_px, *b_py, *b_pz, *b_E, *b_weight;
+
+  Int_t np;
+  std::vector<Int_t> kf;
+  std::vector<T> px, py, pz, E;
+  W weight;
+
+  using clock = std::chrono::steady_clock;
+  using sec = std::chrono::duration<double>;
+
+  TBranch* branch(const char* name, void* addr) {
+    TBranch* b = nullptr;
+    tree->SetBranchAddress(name,addr,&b);
+    if (!b) throw ivanp::error("no branch ",name);
+    return b;
+  }
+
+  void reserve(unsigned n) {
+    kf.resize(n); px.resize(n); py.resize(n); pz.resize(n); E.resize(n);
+    b_kf = branch("kf",kf.data());
+    b_px = branch("px",px.data());
+    b_py = branch("py",py.data());
+    b_pz = branch("pz",pz.data());
+    b_E  = branch("E" ,E .data());
+  }
+
+public:
+  block_read_stats stats; // of the last call
+  bool timed = false; // takes 3 clock reads per entry
+
+  particle_block_reader(TTree* tree): tree(tree) {
+    b_np = branch("nparticle",&np);
+    b_weight = branch("weight2",&weight);
+    reserve(std::max(tree->GetLeaf("nparticle")->GetMaximum(),32));
+
+    tree->SetCacheSize();
+    for (const char* name : {"nparticle","kf","px","py","pz","E","weight2"})
+      tree->AddBranchToCache(name,true);
+  }
+
+  // Read entries [first,last) into the block
+  void operator()(Long64_t first, Long64_t last, particle_block<T>& block) {
+    block.clear();
+    stats = { };
+    TFile* file = tree->GetCurrentFile();
+    const Long64_t bytes = file ? file->GetBytesRead() : 0;
+    for (Long64_t ent=first; ent<last; ++ent) {
+      clock::time_point t0, t1;
+      if (timed) t0 = clock::now();
+      b_np->GetEntry(ent);
+      if (unsigned(np) > kf.size()) reserve(np);
+      b_kf->GetEntry(ent);
+      b_px->GetEntry(ent);
+      b_py->GetEntry(ent);
+      b_pz->GetEntry(ent);
+      b_E ->GetEntry(ent);
+      b_weight->GetEntry(ent);
+      if (timed) t1 = clock::now();
+
+      std::array<T,4> higgs { };
+      for (Int_t i=0; i<np; ++i) {
+        if (kf[i]==25) {
+          higgs = { px[i], py[i], pz[i], E[i] };
+        } else {
+          block.px.push_back(px[i]);
+          block.py.push_back(py[i]);
+          block.pz.push_back(pz[i]);
+          block.E .push_back(E [i]);
+        }
+      }
+      block.offsets.push_back(block.px.size());
+      block.higgs.push_back(higgs);
+      block.weight.push_back(weight);
+      if (timed) {
+        stats.t_read += sec(t1-t0).count();
+        stats.t_extract += sec(clock::now()-t1).count();
+      }
+    }
+    if (file) stats.bytes = file->GetBytesRead() - bytes;
+  }
+};
+
+#endif
@@ -0,0 +1,214 @@
+#ifndef PARTICLE_CACHE_HH
+#define PARTICLE_CACHE_HH
+
+// Columnar cache of the particles read from the input ntuples
+//
+// Layout, every column starting at a multiple of 8 bytes:
+//   header
+//   info string (JSON describing the sources), header.info_size bytes
+//   offsets  uint64 [nevents+1]  non-Higgs particles of each event
+//   weight   float64[nevents]
+//   higgs    T      [nevents][4]
+//   px,py,pz,E T    [nparticles] each
+// T is float or double, as given by header.float_size
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <array>
+#include <fstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ivanp/string.hh"
+#include "ivanp/error.hh"
+
+#include "particle_block.hh"
+
+struct particle_cache_header {
+  char magic[8];
+  std::uint32_t version, float_size;
+  std::uint64_t nevents, nparticles, info_size;
+  char reserved[24];
+};
+static_assert(sizeof(particle_cache_header)==64,"");
+
+constexpr char particle_cache_magic[8] = "ttphPC";
+constexpr std::uint32_t particle_cache_version = 1;
+
+constexpr std::uint64_t align8(std::uint64_t n) noexcept {
+  return (n + 7) & ~std::uint64_t(7);
+}
+
+// Non-owning view of a range of events in the cache
+// Has the same interface as particle_block
+template <typename T>
+struct particle_view {
+  const std::uint64_t *offsets;
+  const double *weight;
+  const std::array<T,4> *higgs;
+  const T *px, *py, *pz, *E;
+  unsigned n;
+
+  unsigned size() const noexcept { return n; }
+};
+
+// Columns are written to temporary files,
+// which are concatenated when the cache is closed
+template <typename T>
+class particle_cache_writer {
+  enum { c_offsets, c_weight, c_higgs, c_px, c_py, c_pz, c_E, ncol };
+
+  std::string path, info;
+  std::ofstream cols[ncol];
+  std::uint64_t nevents = 0, nparticles = 0;
+  std::vector<T> buf;
+
+  std::string col_path(unsigned i) const {
+    return ivanp::cat(path,".tmp",i);
+  }
+
+  template <typename V>
+  void write(unsigned i, const V* p, size_t n) {
+    cols[i].write(reinterpret_cast<const char*>(p),n*sizeof(V));
+  }
+  template <typename U>
+  void write_converted(unsigned i, const std::vector<U>& v) {
+    buf.assign(v.begin(),v.end());
+    write(i,buf.data(),buf.size());
+  }
+
+public:
+  particle_cache_writer(const std::string& path, const std::string& info)
+  : path(path), info(info) {
+    for (unsigned i=0; i<ncol; ++i) {
+      cols[i].open(col_path(i),std::ios::binary);
+      if (!cols[i]) throw ivanp::error("cannot open ",col_path(i));
+    }
+    write(c_offsets,&nparticles,1);
+  }
+
+  template <typename U>
+  void operator()(const particle_block<U>& block) {
+    const unsigned n = block.size();
+    for (unsigned e=0; e<n; ++e) {
+      const std::uint64_t offset = nparticles + block.offsets[e+1];
+      write(c_offsets,&offset,1);
+      const std::array<T,4> higgs {
+        T(block.higgs[e][0]), T(block.higgs[e][1]),
+        T(block.higgs[e][2]), T(block.higgs[e][3]) };
+      write(c_higgs,&higgs,1);
+    }
+    write(c_weight,block.weight.data(),n);
+    write_converted(c_px,block.px);
+    write_converted(c_py,block.py);
+    write_converted(c_pz,block.pz);
+    write_converted(c_E ,block.E );
+    nevents += n;
+    nparticles += block.offsets[n];
+  }
+
+  void close() {
+    const std::string tmp = path + ".tmp";
+    std::ofstream f(tmp,std::ios::binary);
+    particle_cache_header h { };
+    std::memcpy(h.magic,particle_cache_magic,sizeof(h.magic));
+    h.version = particle_cache_version;
+    h.float_size = sizeof(T);
+    h.nevents = nevents;
+    h.nparticles = nparticles;
+    h.info_size = info.size();
+    f.write(reinterpret_cast<const char*>(&h),sizeof(h));
+    f << info;
+
+    std::vector<char> copy_buf(1 << 20);
+    for (unsigned i=0; i<ncol; ++i) {
+      for (auto pos = f.tellp(); pos%8; pos+=1) f.put('\0');
+      cols[i].close();
+      std::ifstream col(col_path(i),std::ios::binary);
+      while (col.read(copy_buf.data(),copy_buf.size()) || col.gcount())
+        f.write(copy_buf.data(),col.gcount());
+      col.close();
+      std::remove(col_path(i).c_str());
+    }
+    f.close();
+    if (!f) throw ivanp::error("failed to write ",tmp);
+    if (std::rename(tmp.c_str(),path.c_str()))
+      throw ivanp::error("cannot rename ",tmp," to ",path);
+  }
+};
+
+// Read-only memory map of a cache file
+class particle_cache {
+  void* data = MAP_FAILED;
+  size_t size = 0;
+  const particle_cache_header* h;
+  const char* cols[7];
+
+public:
+  particle_cache(const std::string& path) {
+    const int fd = ::open(path.c_str(),O_RDONLY);
+    if (fd < 0) throw ivanp::error("cannot open ",path);
+    struct stat st;
+    if (::fstat(fd,&st)) {
+      ::close(fd);
+      throw ivanp::error("cannot stat ",path);
+    }
+    size = st.st_size;
+    if (size >= sizeof(particle_cache_header))
+      data = ::mmap(nullptr,size,PROT_READ,MAP_SHARED,fd,0);
+    ::close(fd);
+    if (data==MAP_FAILED) throw ivanp::error("cannot map ",path);
+    ::madvise(data,size,MADV_SEQUENTIAL);
+
+    h = static_cast<const particle_cache_header*>(data);
+    if (std::memcmp(h->magic,particle_cache_magic,sizeof(h->magic)) ||
+        h->version!=particle_cache_version ||
+        (h->float_size!=sizeof(float) && h->float_size!=sizeof(double)))
+      throw ivanp::error(path," is not a particle cache");
+
+    const std::uint64_t lens[7] {
+      (h->nevents+1)*8, h->nevents*8, h->nevents*4*h->float_size,
+      h->nparticles*h->float_size, h->nparticles*h->float_size,
+      h->nparticles*h->float_size, h->nparticles*h->float_size
+    };
+    std::uint64_t pos = sizeof(particle_cache_header) + h->info_size;
+    for (unsigned i=0; i<7; ++i) {
+      pos = align8(pos);
+      cols[i] = static_cast<const char*>(data) + pos;
+      pos += lens[i];
+    }
+    if (pos > size) throw ivanp::error(path," is truncated");
+  }
+  ~particle_cache() { if (data!=MAP_FAILED) ::munmap(data,size); }
+
+  particle_cache(const particle_cache&) = delete;
+  particle_cache& operator=(const particle_cache&) = delete;
+
+  std::string info() const {
+    return { reinterpret_cast<const char*>(h+1), size_t(h->info_size) };
+  }
+  bool is_double() const noexcept { return h->float_size==sizeof(double); }
+  std::uint64_t nevents() const noexcept { return h->nevents; }
+
+  template <typename T>
+  particle_view<T> view(std::uint64_t first, std::uint64_t last) const {
+    return {
+      reinterpret_cast<const std::uint64_t*>(cols[0]) + first,
+      reinterpret_cast<const double*>(cols[1]) + first,
+      reinterpret_cast<const std::array<T,4>*>(cols[2]) + first,
+      reinterpret_cast<const T*>(cols[3]),
+      reinterpret_cast<const T*>(cols[4]),
+      reinterpret_cast<const T*>(cols[5]),
+      reinterpret_cast<const T*>(cols[6]),
+      unsigned(last-first)
+    };
+  }
+};
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef WRITE_FILE_HH
+#define WRITE_FILE_HH
+
+#include <string>
+#include <fstream>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ivanp/error.hh"
+
+// Write str to name through a temporary file, which replaces name
+// only if it was written completely, so that a failed write
+// does not leave a truncated file behind
+// With sync, the data are on disk before the file is replaced
+inline void write_file(
+  const std::string& name, const std::string& str, bool sync = false
+) {
+  const std::string tmp = name + ".tmp";
+  { std::ofstream f(tmp);
+    f << str;
+    f.close();
+    if (!f) throw ivanp::error("failed to write ",tmp);
+  }
+  if (sync) {
+    const int fd = ::open(tmp.c_str(),O_RDONLY);
+    const bool ok = fd >= 0 && !::fsync(fd);
+    if (fd >= 0) ::close(fd);
+    if (!ok) throw ivanp::error("cannot sync ",tmp);
+  }
+  if (std::rename(tmp.c_str(),name.c_str()))
+    throw ivanp::error("cannot rename ",tmp," to ",name);
+}
+
+#endif
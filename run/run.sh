@@ -11,7 +11,8 @@ for f in $(ls | grep '.json$'); do
      [ -n "$(find dat -name "${base}*" -not -newer ../bin/vars)" ]
   then
     echo $f
-    ../bin/vars $f -o dat/$base \
+    ../bin/vars $f -o dat/$base --incremental \
+      --entries-cache dat/entries.json \
       -b 200 250 300 350 400 450 500
   fi
 done
@@ -0,0 +1,170 @@
+// Compare reading particle momenta through float_or_double readers,
+// which test the branch type on every access, with reading through
+// TTreeReaderArray instantiated for the branch type
+
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+#include <algorithm>
+#include <type_traits>
+#include <random>
+#include <chrono>
+
+#include <TTree.h>
+#include <TTreeReader.h>
+#include <TTreeReaderValue.h>
+#include <TTreeReaderArray.h>
+
+#include "ivanp/string.hh"
+#include "ivanp/program_options.hh"
+
+#include "float_or_double_reader.hh"
+#include "iftty.hh"
+
+using std::cout;
+using std::cerr;
+using std::endl;
+using ivanp::cat;
+
+constexpr Int_t max_np = 64;
+
+template <typename T>
+void fill_tree(TTree& tree, Long64_t nevents, Int_t np_mean) {
+  Int_t nparticle;
+  Int_t kf[max_np];
+  T px[max_np], py[max_np], pz[max_np], E[max_np];
+  Double_t weight2;
+
+  tree.Branch("nparticle",&nparticle,"nparticle/I");
+  tree.Branch("kf",kf,"kf[nparticle]/I");
+  const char* type = std::is_same<T,Double_t>::value ? "D" : "F";
+  tree.Branch("px",px,cat("px[nparticle]/",type).c_str());
+  tree.Branch("py",py,cat("py[nparticle]/",type).c_str());
+  tree.Branch("pz",pz,cat("pz[nparticle]/",type).c_str());
+  tree.Branch("E" ,E ,cat("E[nparticle]/" ,type).c_str());
+  tree.Branch("weight2",&weight2,"weight2/D");
+
+  std::mt19937 gen;
+  // particles besides the Higgs, the mean of a Poisson must be positive
+  std::poisson_distribution<Int_t> multiplicity(std::max(np_mean-1,1));
+  std::normal_distribution<T> momentum(0,50);
+  std::exponential_distribution<Double_t> weight;
+
+  for (Long64_t ent=0; ent<nevents; ++ent) {
+    nparticle = std::min(1 + (np_mean > 1 ? multiplicity(gen) : 0),max_np);
+    for (Int_t i=0; i<nparticle; ++i) {
+      kf[i] = (i ? 21 : 25);
+      px[i] = momentum(gen);
+      py[i] = momentum(gen);
+      pz[i] = 4*momentum(gen);
+      E [i] = std::sqrt(px[i]*px[i] + py[i]*py[i] + pz[i]*pz[i]);
+    }
+    weight2 = weight(gen);
+    tree.Fill();
+  }
+}
+
+// Reads the same values as the particle loop in vars
+// and reduces them to a checksum, so that nothing is optimized away
+double read_dispatched(TTree& tree) {
+  TTreeReader reader(&tree);
+  TTreeReaderValue<Int_t> _nparticle(reader,"nparticle");
+  TTreeReaderArray<Int_t> _kf(reader,"kf");
+  float_or_double_array_reader _px(reader,"px");
+  float_or_double_array_reader _py(reader,"py");
+  float_or_double_array_reader _pz(reader,"pz");
+  float_or_double_array_reader _E (reader,"E" );
+  float_or_double_value_reader _weight(reader,"weight2");
+
+  double sum = 0;
+  while (reader.Next()) {
+    const unsigned np = *_nparticle;
+    for (unsigned i=0; i<np; ++i)
+      if (_kf[i]!=25) sum += _px[i] + _py[i] + _pz[i] + _E[i];
+    sum += *_weight;
+  }
+  return sum;
+}
+
+template <typename T, typename W>
+double read_typed(TTree& tree) {
+  TTreeReader reader(&tree);
+  TTreeReaderValue<Int_t> _nparticle(reader,"nparticle");
+  TTreeReaderArray<Int_t> _kf(reader,"kf");
+  TTreeReaderArray<T> _px(reader,"px");
+  TTreeReaderArray<T> _py(reader,"py");
+  TTreeReaderArray<T> _pz(reader,"pz");
+  TTreeReaderArray<T> _E (reader,"E" );
+  TTreeReaderValue<W> _weight(reader,"weight2");
+
+  double sum = 0;
+  while (reader.Next()) {
+    const unsigned np = *_nparticle;
+    for (unsigned i=0; i<np; ++i)
+      if (_kf[i]!=25) sum += _px[i] + _py[i] + _pz[i] + _E[i];
+    sum += *_weight;
+  }
+  return sum;
+}
+
+template <typename F>
+double timed(const char* name, Long64_t nevents, unsigned nrep, F&& f) {
+  using clock = std::chrono::steady_clock;
+  double sum = f(); // warm up
+  const auto t0 = clock::now();
+  for (unsigned i=0; i<nrep; ++i) sum = f();
+  const double t = std::chrono::duration<double>(clock::now()-t0).count();
+  cout << std::setw(12) << std::left << name << std::right << std::fixed
+       << std::setprecision(3) << std::setw(9) << t/nrep << " s  "
+       << std::setprecision(0) << std::setw(12) << nevents*nrep/t
+       << " events/s  (checksum " << std::scientific << std::setprecision(6)
+       << sum << ")" << endl;
+  return t;
+}
+
+int main(int argc, char* argv[]) {
+  Long64_t nevents = 1000000;
+  Int_t np_mean = 4;
+  unsigned nrep = 3;
+  bool use_double = false;
+
+  try {
+    using namespace ivanp::po;
+    if (program_options()
+      (nevents,'n',cat("number of events [",nevents,']'))
+      (np_mean,'p',cat("mean number of particles [",np_mean,']'))
+      (nrep,'r',cat("number of repetitions [",nrep,']'))
+      (use_double,{"-d","--double"},"Double_t momentum branches")
+      .parse(argc,argv,true)) return 0;
+  } catch (const std::exception& e) {
+    cerr << iftty("\033[31m",2) << e.what() << iftty("\033[0m",2) << endl;
+    return 1;
+  }
+  // ================================================================
+
+  if (np_mean < 1) {
+    cerr << iftty("\033[31m",2) << "need at least 1 particle"
+         << iftty("\033[0m",2) << endl;
+    return 1;
+  }
+
+  TTree tree("t3","synthetic");
+  tree.SetDirectory(nullptr);
+  if (use_double) fill_tree<Double_t>(tree,nevents,np_mean);
+  else            fill_tree<Float_t >(tree,nevents,np_mean);
+
+  cout << iftty("\033[34m") << nevents << " events, "
+       << (use_double ? "Double_t" : "Float_t") << iftty("\033[0m") << endl;
+
+  const double t1 = timed("dispatched",nevents,nrep,[&]{
+    return read_dispatched(tree);
+  });
+  double t2;
+  float_or_double(branches_are_double(&tree,{"px","py","pz","E"}),
+  [&](auto p){
+    t2 = timed("typed",nevents,nrep,[&]{
+      return read_typed<decltype(p),Double_t>(tree);
+    });
+  });
+  cout << "speedup: " << std::fixed << std::setprecision(2) << t1/t2 << endl;
+}
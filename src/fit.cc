@@ -2,7 +2,12 @@
 #include <iomanip>
 #include <fstream>
 #include <vector>
+#include <array>
 #include <chrono>
+#include <memory>
+#include <exception>
+#include <cstdlib>
+#include <algorithm>
 
 #include <boost/optional.hpp>
 
@@ -12,11 +17,15 @@
 #include "ivanp/math/math.hh"
 #include "ivanp/program_options.hh"
 #include "ivanp/binner.hh"
-#include "ivanp/root/minuit.hh"
+#include "ivanp/error.hh"
+
+#include <TMinuit.h>
 
 #include "Legendre.hh"
+#include "likelihood.hh"
 #include "iftty.hh"
 #include "event.hh"
+#include "dat_format.hh"
 
 #define TEST(var) \
   std::cout << "\033[36m" #var "\033[0m = " << var << std::endl;
@@ -48,16 +57,45 @@ public:
 struct bin {
   double w = 0, w2 = 0;
   unsigned n = 0;
-  void operator()() noexcept {
-    w  += event.weight;
-    w2 += sq(event.weight);
+  void operator()(double weight) noexcept {
+    w  += weight;
+    w2 += sq(weight);
     ++n;
   }
+  bin& operator+=(const bin& o) noexcept {
+    w  += o.w;
+    w2 += o.w2;
+    n  += o.n;
+    return *this;
+  }
 };
+using hist_t = ivanp::binner<bin, std::tuple<
+  ivanp::axis_spec<ivanp::uniform_axis<double>,0,0> > >;
 
 #define NPAR 4
 const char* par_name[NPAR] = {"c2","c4","c6","phi2"};
 
+// Minuit with an objective f(par,grad) that returns the value
+// and also fills the gradient if grad is not null
+template <typename F>
+class grad_minuit final : public TMinuit {
+  F f;
+public:
+  grad_minuit(Int_t npar, F f): TMinuit(npar), f(f) { }
+  Int_t Eval(
+    Int_t, Double_t* grad, Double_t& fval, Double_t* par, Int_t flag
+  ) override {
+    fval = f(par, flag==2 ? grad : nullptr);
+    return 0;
+  }
+  // Minuit compares the gradient with finite differences first,
+  // and falls back to them if it does not agree
+  void UseGradient() {
+    Int_t err;
+    mnexcm("SET GRA",nullptr,0,err);
+  }
+};
+
 int main(int argc, char* argv[]) {
   std::vector<const char*> ifnames;
   const char* ofname;
@@ -65,6 +103,11 @@ int main(int argc, char* argv[]) {
   unsigned nbins = 100;
   double cos_range = 1;
   boost::optional<double> fix_phi;
+  const char* mass_window = nullptr;
+  const char* var = "cos_theta";
+  bool basis_cache = false;
+  bool check_kernel = false;
+  bool no_grad = false;
 
   try {
     using namespace ivanp::po;
@@ -74,6 +117,17 @@ int main(int argc, char* argv[]) {
       (nbins,'n',cat("number of cosθ bins [",nbins,']'))
       (cos_range,'r',cat("cosθ range [",cos_range,']'))
       (fix_phi,"--phi","fix phase value")
+      (mass_window,'m',"mass window lo:hi, for input sorted by mass")
+      (var,"--var",cat("angular observable to fit [",var,']'))
+      (basis_cache,"--basis-cache",
+       "store Legendre polynomials and weights of events,\n"
+       "the likelihood is faster, but takes 32 bytes per event\n"
+       "on top of the mapped input files")
+      (check_kernel,"--check-kernel",
+       "compare the vectorized likelihood kernel with Legendre()\n"
+       "on the input events and exit")
+      (no_grad,"--no-grad",
+       "let Minuit compute derivatives by finite differences")
       (print_level,"--print-level",
        "-1 - quiet (also suppress all warnings)\n"
        " 0 - normal (default)\n"
@@ -85,38 +139,141 @@ int main(int argc, char* argv[]) {
   }
   // ================================================================
 
-  std::vector<decltype(event)> events;
+  double mass_lo = 0, mass_hi = 0;
+  if (mass_window) {
+    char* end;
+    mass_lo = std::strtod(mass_window,&end);
+    if (*end==':') mass_hi = std::strtod(end+1,&end);
+    if (*end || !(mass_lo < mass_hi)) {
+      cerr << iftty("\033[31m",2) << "bad mass window \"" << mass_window
+           << '\"' << iftty("\033[0m",2) << endl;
+      return 1;
+    }
+  }
+
+  event_store events;
   double total_weight = 0;
 
-  ivanp::binner<bin, std::tuple<
-    ivanp::axis_spec<ivanp::uniform_axis<double>,0,0> >
-  > hist({nbins,-1,1});
+  hist_t hist({nbins,-1,1});
 
   nlohmann::json info;
 
   timer.start();
 
-  for (auto& ifname : ifnames) {
-    cout << iftty("\033[34m") << "Input file" << iftty("\033[0m")
-         << ": " << ifname << endl;
-    std::ifstream f(ifname);
-    std::string line;
-    std::getline(f,line);
-    info.merge_patch(nlohmann::json::parse(line));
-    while (f) {
-      f.read(reinterpret_cast<char*>(&event),sizeof(event));
-      if (std::abs(event.cos_theta) > cos_range) continue;
-      event.cos_theta /= cos_range;
-      events.emplace_back(event);
-      hist(event.cos_theta);
+  // The files stay mapped, since events may point into their records
+  const unsigned nfiles = ifnames.size();
+  std::vector<std::unique_ptr<dat_file>> files(nfiles);
+  {
+    // Files are read concurrently, each into its own segment
+    // and histogram, which are then merged in the order of the files,
+    // so that the result does not depend on the number of threads
+    std::vector<nlohmann::json> infos(nfiles);
+    std::vector<event_segment> segments(nfiles);
+    std::vector<std::unique_ptr<hist_t>> hists(nfiles);
+    std::vector<std::exception_ptr> errors(nfiles);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (unsigned k=0; k<nfiles; ++k) {
+      try {
+        const char* ifname = ifnames[k];
+        files[k].reset(new dat_file(ifname));
+        const dat_file& f = *files[k];
+        const auto fields = f.fields();
+        const auto var_it = std::find(fields.begin(),fields.end(),var);
+        if (var_it==fields.end())
+          throw ivanp::error("no field \"",var,"\" in ",ifname);
+        std::pair<std::uint64_t,std::uint64_t> range(0,f.nevents());
+        if (mass_window) {
+          if (f.sort_field() < 0 || fields[f.sort_field()]!="mass")
+            throw ivanp::error(ifname," is not sorted by mass");
+          range = f.select(mass_lo,mass_hi);
+        }
+        infos[k] = nlohmann::json::parse(f.info());
+
+        auto& s = segments[k] = select_events(f,range.first,range.second,
+          var_it - fields.begin(),cos_range);
+        hists[k].reset(new hist_t({nbins,-1,1}));
+        auto& h = *hists[k];
+        for (size_t i=0; i<s.n; ++i) h(s.x[i*s.stride],s.w[i*s.stride]);
+      } catch (...) {
+        errors[k] = std::current_exception();
+      }
     }
+    for (auto& e : errors) if (e) std::rethrow_exception(e);
+
+    for (unsigned k=0; k<nfiles; ++k) {
+      cout << iftty("\033[34m") << "Input file" << iftty("\033[0m")
+           << ": " << ifnames[k] << endl;
+      info.merge_patch(infos[k]);
+      events.add(std::move(segments[k]));
+      for (unsigned i=0; i<nbins; ++i)
+        hist.bins()[i] += hists[k]->bins()[i];
+    }
+    if (mass_window) info["M"] = { mass_lo, mass_hi };
+    info["var"] = var;
   }
 
   for (auto& b : hist.bins()) total_weight += b.w;
+  if (basis_cache || check_kernel) events.cache_basis();
 
   timer.print("Read time");
   timer.start();
 
+  // The kernel must agree with the complex arithmetic of Legendre()
+  // up to rounding
+  if (check_kernel) {
+    const auto& b = events.basis();
+    const size_t n = b.size();
+    std::vector<double> f(n);
+    double max_diff = 0, max_grad_diff = 0, max_seg_diff = 0;
+    for (const auto& c : std::vector<std::array<double,NPAR>>{
+      {0,0,0,0}, {0.3,-0.2,0.1,0.7}, {-0.4,0.5,0.3,2.5}
+    }) {
+      const legendre_coefs k(c.data());
+      legendre_kernel(k,n,b.p2.data(),b.p4.data(),b.p6.data(),f.data());
+      double grad[NPAR] = { }, ref_grad[NPAR] = { }, abs_grad[NPAR] = { };
+      legendre_logl(k,n,b.w.data(),
+        b.p2.data(),b.p4.data(),b.p6.data(),grad);
+      for (size_t i=0; i<n; ++i) {
+        double g[NPAR];
+        const double ref = Legendre(b.p2[i],b.p4[i],b.p6[i],c.data(),g);
+        max_diff = std::max(max_diff,std::abs(f[i]-ref)/ref);
+        for (unsigned j=0; j<NPAR; ++j) {
+          ref_grad[j] += b.w[i]*g[j]/ref;
+          abs_grad[j] += std::abs(b.w[i]*g[j]/ref);
+        }
+      }
+      // the sums are in a different order, so compare them
+      // relative to the magnitude of their terms
+      for (unsigned j=0; j<NPAR; ++j) if (abs_grad[j] > 0)
+        max_grad_diff = std::max(max_grad_diff,
+          std::abs(grad[j]-ref_grad[j])/abs_grad[j]);
+
+      // without the cache, the basis is computed from the records
+      double logl = 0, seg_logl = 0, abs_logl = 0, seg_grad[NPAR] = { };
+      for (size_t i=0; i<n; ++i) {
+        logl += b.w[i]*std::log(f[i]);
+        abs_logl += std::abs(b.w[i]*std::log(f[i]));
+      }
+      for (const auto& s : events.segments())
+        seg_logl += legendre_logl(k,s.n,s.stride,s.w,s.x,seg_grad);
+      if (abs_logl > 0)
+        max_seg_diff = std::max(max_seg_diff,
+          std::abs(seg_logl-logl)/abs_logl);
+      for (unsigned j=0; j<NPAR; ++j) if (abs_grad[j] > 0)
+        max_seg_diff = std::max(max_seg_diff,
+          std::abs(seg_grad[j]-ref_grad[j])/abs_grad[j]);
+    }
+    const bool ok = max_diff <= 1e-14 && max_grad_diff <= 1e-10
+                 && max_seg_diff <= 1e-10;
+    cout << iftty(ok ? "\033[32m" : "\033[31m") << "Kernel check"
+         << iftty("\033[0m") << ": max relative difference " << max_diff
+         << ", of the gradient " << max_grad_diff
+         << ", from records " << max_seg_diff
+         << " over " << n << " events" << endl;
+    return !ok;
+  }
+
   // Chi2 fit =====================================================
   std::vector<std::array<double,3>> chi2_data;
   chi2_data.reserve(nbins);
@@ -130,10 +287,19 @@ int main(int argc, char* argv[]) {
     });
   }
 
-  auto fChi2 = [=,&b=chi2_data](const double* c) -> double {
+  auto fChi2 = [=,&b=chi2_data](
+    const double* c, double* grad = nullptr
+  ) -> double {
     double chi2 = 0.;
-    for (unsigned i=0; i<nbins; ++i)
-      chi2 += sq(b[i][0] - Legendre(b[i][2],c))/b[i][1];
+    double g[NPAR];
+    if (grad) std::fill(grad,grad+NPAR,0.);
+    for (unsigned i=0; i<nbins; ++i) {
+      const double d = b[i][0]
+        - (grad ? Legendre(b[i][2],c,g) : Legendre(b[i][2],c));
+      chi2 += sq(d)/b[i][1];
+      if (grad) for (unsigned j=0; j<NPAR; ++j)
+        grad[j] -= 2.*d*g[j]/b[i][1];
+    }
     return chi2;
   };
 
@@ -142,7 +308,7 @@ int main(int argc, char* argv[]) {
     chi2_errs;
 
   auto fit_Chi2 = [&]{
-    auto m = make_minuit(NPAR,fChi2);
+    grad_minuit<decltype(fChi2)> m(NPAR,fChi2);
     m.SetPrintLevel(print_level);
 
     for (unsigned i=0; i<NPAR; ++i)
@@ -156,6 +322,7 @@ int main(int argc, char* argv[]) {
       );
 
     if (fix_phi) m.FixParameter(3);
+    if (!no_grad) m.UseGradient();
 
     m.Migrad();
     for (unsigned i=0; i<NPAR; ++i)
@@ -167,19 +334,40 @@ int main(int argc, char* argv[]) {
   timer.start();
 
   // LogL fit =====================================================
-  auto fLogL = [&](const double* c) -> double {
+  auto fLogL = [&](const double* c, double* grad = nullptr) -> double {
     long double logl = 0.;
-    const unsigned n = events.size();
-    #pragma omp parallel for reduction(+:logl)
-    for (unsigned i=0; i<n; ++i)
-      logl += events[i].weight*std::log(Legendre(events[i].cos_theta,c));
+    double g[NPAR] = { }; // gradient of logl
+    // chunks of events are passed to the vectorized kernel
+    const legendre_coefs k(c);
+    constexpr size_t chunk = 1 << 14;
+    if (events.has_basis()) {
+      const auto& b = events.basis();
+      const double *w = b.w.data(),
+                   *p2 = b.p2.data(), *p4 = b.p4.data(), *p6 = b.p6.data();
+      const size_t n = b.size();
+      #pragma omp parallel for reduction(+:logl,g[:NPAR]) schedule(static)
+      for (size_t a=0; a<n; a+=chunk) {
+        const size_t m = std::min(chunk,n-a);
+        logl += grad
+          ? legendre_logl(k,m,w+a,p2+a,p4+a,p6+a,g)
+          : legendre_logl(k,m,w+a,p2+a,p4+a,p6+a);
+      }
+    } else for (const auto& s : events.segments()) {
+      const double *w = s.w, *x = s.x;
+      const size_t n = s.n, stride = s.stride;
+      #pragma omp parallel for reduction(+:logl,g[:NPAR]) schedule(static)
+      for (size_t a=0; a<n; a+=chunk)
+        logl += legendre_logl(k,std::min(chunk,n-a),stride,
+          w+a*stride,x+a*stride,grad ? g : nullptr);
+    }
+    if (grad) for (unsigned j=0; j<NPAR; ++j) grad[j] = -2.*g[j];
     return -2.*logl;
   };
 
   std::array<double,NPAR> logl_pars(chi2_pars), logl_errs;
 
   auto fit_LogL = [&]{
-    auto m = make_minuit(NPAR,fLogL);
+    grad_minuit<decltype(fLogL)> m(NPAR,fLogL);
     m.SetPrintLevel(print_level);
 
     for (unsigned i=0; i<NPAR; ++i)
@@ -193,6 +381,7 @@ int main(int argc, char* argv[]) {
       );
 
     if (fix_phi) m.FixParameter(3);
+    if (!no_grad) m.UseGradient();
 
     m.Migrad();
     for (unsigned i=0; i<NPAR; ++i)
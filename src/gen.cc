@@ -0,0 +1,140 @@
+// Generate a ROOT ntuple with the branches vars reads,
+// for benchmarking without the real samples
+// Partons are massless, with exponential pT above pt_min and flat
+// pseudorapidity, and the Higgs balances their transverse momentum
+
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+#include <type_traits>
+#include <random>
+
+#include <TFile.h>
+#include <TTree.h>
+
+#include "ivanp/string.hh"
+#include "ivanp/program_options.hh"
+#include "ivanp/timed_counter.hh"
+
+#include "iftty.hh"
+
+using std::cout;
+using std::cerr;
+using std::endl;
+using ivanp::cat;
+
+constexpr Int_t max_np = 64;
+
+struct gen_opts {
+  Long64_t nevents = 100000;
+  Int_t np_mean = 1; // partons besides the Higgs
+  double pt_min = 25, pt_mean = 40, eta_max = 4.5;
+  unsigned seed = 0;
+};
+
+// T and W are the types of the momentum and weight branches
+template <typename T, typename W>
+void fill_tree(TTree& tree, const gen_opts& opts) {
+  Int_t nparticle;
+  Int_t kf[max_np];
+  T px[max_np], py[max_np], pz[max_np], E[max_np];
+  W weight2;
+
+  auto type = [](auto x){
+    return std::is_same<decltype(x),Double_t>::value ? "D" : "F";
+  };
+  const char* t = type(T{});
+  tree.Branch("nparticle",&nparticle,"nparticle/I");
+  tree.Branch("kf",kf,"kf[nparticle]/I");
+  tree.Branch("px",px,cat("px[nparticle]/",t).c_str());
+  tree.Branch("py",py,cat("py[nparticle]/",t).c_str());
+  tree.Branch("pz",pz,cat("pz[nparticle]/",t).c_str());
+  tree.Branch("E" ,E ,cat("E[nparticle]/" ,t).c_str());
+  tree.Branch("weight2",&weight2,cat("weight2/",type(W{})).c_str());
+
+  constexpr double mH = 125;
+  std::mt19937 gen(opts.seed);
+  // partons beyond the first, the mean of a Poisson must be positive
+  std::poisson_distribution<Int_t> extra(std::max(opts.np_mean-1,1));
+  std::exponential_distribution<double> pt(1./(opts.pt_mean-opts.pt_min));
+  std::uniform_real_distribution<double> eta(-opts.eta_max,opts.eta_max);
+  std::uniform_real_distribution<double> phi(-M_PI,M_PI);
+  std::normal_distribution<double> y(0,1.5);
+  std::exponential_distribution<double> weight;
+  std::bernoulli_distribution gluon(0.7);
+
+  using cnt = ivanp::timed_counter<Long64_t>;
+  for (cnt ent(opts.nevents); ent < opts.nevents; ++ent) {
+    nparticle = std::min(2 + (opts.np_mean > 1 ? extra(gen) : 0),max_np);
+    double sx = 0, sy = 0;
+    for (Int_t i=1; i<nparticle; ++i) {
+      const double pt_i = opts.pt_min + pt(gen);
+      const double eta_i = eta(gen), phi_i = phi(gen);
+      kf[i] = gluon(gen) ? 21 : 1 + int(gen()%5);
+      px[i] = pt_i*std::cos(phi_i);
+      py[i] = pt_i*std::sin(phi_i);
+      pz[i] = pt_i*std::sinh(eta_i);
+      E [i] = pt_i*std::cosh(eta_i);
+      sx += px[i];
+      sy += py[i];
+    }
+    const double y_H = y(gen);
+    const double mT = std::sqrt(mH*mH + sx*sx + sy*sy);
+    kf[0] = 25;
+    px[0] = -sx;
+    py[0] = -sy;
+    pz[0] = mT*std::sinh(y_H);
+    E [0] = mT*std::cosh(y_H);
+    weight2 = weight(gen);
+    tree.Fill();
+  }
+}
+
+int main(int argc, char* argv[]) {
+  const char* ofname;
+  const char* tree_name = "t3";
+  gen_opts opts;
+  bool use_double = false, float_weight = false;
+
+  try {
+    using namespace ivanp::po;
+    if (program_options()
+      (ofname,'o',"output ROOT file",req(),pos())
+      (opts.nevents,'n',cat("number of events [",opts.nevents,']'))
+      (opts.np_mean,'p',cat(
+        "mean number of partons, at least 1 [",opts.np_mean,']'))
+      (opts.seed,'s',cat("random seed [",opts.seed,']'))
+      (opts.pt_min,"--pt-min",cat("min parton pT [",opts.pt_min,']'))
+      (opts.pt_mean,"--pt-mean",cat("mean parton pT [",opts.pt_mean,']'))
+      (opts.eta_max,"--eta",cat("max parton |eta| [",opts.eta_max,']'))
+      (tree_name,{"-t","--tree"},cat("TTree name [",tree_name,']'))
+      (use_double,{"-d","--double"},"Double_t momentum branches")
+      (float_weight,"--float-weight","Float_t weight branch")
+      .parse(argc,argv,true)) return 0;
+  } catch (const std::exception& e) {
+    cerr << iftty("\033[31m",2) << e.what() << iftty("\033[0m",2) << endl;
+    return 1;
+  }
+  // ================================================================
+
+  if (opts.np_mean < 1 || !(opts.pt_mean > opts.pt_min)) {
+    cerr << iftty("\033[31m",2) << "need at least 1 parton"
+            " and mean pT above min pT" << iftty("\033[0m",2) << endl;
+    return 1;
+  }
+
+  TFile file(ofname,"recreate");
+  if (file.IsZombie()) return 1;
+  TTree tree(tree_name,"synthetic");
+
+  if (use_double) {
+    if (float_weight) fill_tree<Double_t,Float_t >(tree,opts);
+    else              fill_tree<Double_t,Double_t>(tree,opts);
+  } else {
+    if (float_weight) fill_tree<Float_t ,Float_t >(tree,opts);
+    else              fill_tree<Float_t ,Double_t>(tree,opts);
+  }
+
+  file.Write();
+  cout << iftty("\033[36m") << "Wrote " << iftty("\033[0m") << ofname << endl;
+}
@@ -1,6 +1,7 @@
 #include "glob.hh"
 #include <stdexcept>
 #include "ivanp/string.hh"
+#include "parallel_for.hh"
 #include "glob.h"
 
 namespace ivanp {
@@ -26,4 +27,75 @@ std::vector<std::string> glob(const std::string& pattern) {
   return list;
 }
 
+// Matching closing brace, or npos
+static std::string::size_type close_brace(
+  const std::string& s, std::string::size_type open
+) {
+  unsigned depth = 0;
+  for (auto i=open; i<s.size(); ++i) {
+    if (s[i]=='\\') ++i;
+    else if (s[i]=='{') ++depth;
+    else if (s[i]=='}' && !--depth) return i;
+  }
+  return std::string::npos;
+}
+
+std::vector<std::string> expand_braces(const std::string& pattern) {
+  for (std::string::size_type open=0; open<pattern.size(); ++open) {
+    if (pattern[open]=='\\') { ++open; continue; }
+    if (pattern[open]!='{') continue;
+    const auto close = close_brace(pattern,open);
+    if (close==std::string::npos) break;
+
+    // split at top level commas
+    std::vector<std::string> alts;
+    unsigned depth = 0;
+    auto start = open+1;
+    for (auto i=start; i<close; ++i) {
+      if (pattern[i]=='\\') ++i;
+      else if (pattern[i]=='{') ++depth;
+      else if (pattern[i]=='}') --depth;
+      else if (pattern[i]==',' && !depth) {
+        alts.push_back(pattern.substr(start,i-start));
+        start = i+1;
+      }
+    }
+    if (alts.empty()) { open = close; continue; } // no comma
+    alts.push_back(pattern.substr(start,close-start));
+
+    const std::string pre = pattern.substr(0,open),
+                      post = pattern.substr(close+1);
+    std::vector<std::string> list;
+    for (const auto& alt : alts)
+      for (auto& s : expand_braces(pre + alt + post))
+        list.push_back(std::move(s));
+    return list;
+  }
+  return { pattern };
+}
+
+std::vector<std::vector<std::string>> glob(
+  const std::vector<std::string>& patterns, unsigned nthreads
+) {
+  struct task { unsigned pattern; std::string sub; };
+  std::vector<task> tasks;
+  for (unsigned i=0; i<patterns.size(); ++i)
+    for (auto& sub : expand_braces(patterns[i]))
+      tasks.push_back({ i, std::move(sub) });
+
+  std::vector<std::vector<std::string>> matches(tasks.size());
+  parallel_for(tasks.size(),nthreads,[&](unsigned i){
+    matches[i] = glob(tasks[i].sub);
+  });
+
+  std::vector<std::vector<std::string>> lists(patterns.size());
+  for (unsigned i=0; i<tasks.size(); ++i) {
+    auto& list = lists[tasks[i].pattern];
+    list.insert(list.end(),
+      std::make_move_iterator(matches[i].begin()),
+      std::make_move_iterator(matches[i].end()));
+  }
+  return lists;
+}
+
 }
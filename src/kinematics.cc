@@ -0,0 +1,132 @@
+#include "kinematics.hh"
+#include <cmath>
+#include "ivanp/error.hh"
+
+// Kernels are compiled for several instruction sets
+// and selected at load time
+#define KERNEL __attribute__((target_clones("avx512f","avx2","default")))
+
+namespace {
+
+using cdp = const double* __restrict;
+using dp  = double* __restrict;
+
+// Q = H + j, mass, and ell = (Q.j/Q2) H - (Q.H/Q2) j
+// Operations are in the same order as in the scalar vec4 code
+KERNEL void rest_frame(
+  unsigned n, cdp Hx, cdp Hy, cdp Hz, cdp HE, cdp jx, cdp jy, cdp jz, cdp jE,
+  dp Qx, dp Qy, dp Qz, dp QE, dp Q2, dp mass, dp lz, dp lE, dp l2
+) {
+  for (unsigned i=0; i<n; ++i) {
+    const double x = Hx[i] + jx[i], y = Hy[i] + jy[i],
+                 z = Hz[i] + jz[i], E = HE[i] + jE[i];
+    const double QQ = E*E - x*x - y*y - z*z;
+    const double Qj = E*jE[i] - x*jx[i] - y*jy[i] - z*jz[i];
+    const double QH = E*HE[i] - x*Hx[i] - y*Hy[i] - z*Hz[i];
+
+    const double a = Qj/QQ, b = QH/QQ;
+    const double ex = Hx[i]*a - jx[i]*b, ey = Hy[i]*a - jy[i]*b,
+                 ez = Hz[i]*a - jz[i]*b, eE = HE[i]*a - jE[i]*b;
+
+    Qx[i] = x; Qy[i] = y; Qz[i] = z; QE[i] = E; Q2[i] = QQ;
+    mass[i] = std::sqrt(QQ);
+    lz[i] = ez; lE[i] = eE;
+    l2[i] = eE*eE - ex*ex - ey*ey - ez*ez;
+  }
+}
+
+// Z = (0,0,E_Q,pz_Q)
+KERNEL void cos_theta(
+  unsigned n, cdp Qz, cdp QE, cdp lz, cdp lE, cdp l2, dp out
+) {
+  for (unsigned i=0; i<n; ++i) {
+    const double lZ = lE[i]*Qz[i] - lz[i]*QE[i];
+    const double Z2 = Qz[i]*Qz[i] - QE[i]*QE[i];
+    out[i] = lZ / std::sqrt(l2[i]*Z2);
+  }
+}
+
+// Z = (E_Q/Q^2) Q - T, ell.Z = -ell.T, Z^2 = -|Q|^2/Q^2
+KERNEL void cos_theta_hel(
+  unsigned n, cdp Qx, cdp Qy, cdp Qz, cdp Q2, cdp lE, cdp l2, dp out
+) {
+  for (unsigned i=0; i<n; ++i) {
+    const double Z2 = -(Qx[i]*Qx[i] + Qy[i]*Qy[i] + Qz[i]*Qz[i])/Q2[i];
+    out[i] = -lE[i] / std::sqrt(l2[i]*Z2);
+  }
+}
+
+// Z = P1 - (Q.P1/Q^2) Q, ell.Z = ell.P1, Z^2 = -(Q.P1)^2/Q^2
+KERNEL void cos_theta_GJ(
+  unsigned n, cdp Qz, cdp QE, cdp Q2, cdp lz, cdp lE, cdp l2, dp out
+) {
+  for (unsigned i=0; i<n; ++i) {
+    const double a = QE[i] - Qz[i];
+    out[i] = (lE[i] - lz[i]) / std::sqrt(l2[i]*(-a*a/Q2[i]));
+  }
+}
+
+KERNEL void pT(unsigned n, cdp Qx, cdp Qy, dp out) {
+  for (unsigned i=0; i<n; ++i)
+    out[i] = std::sqrt(Qx[i]*Qx[i] + Qy[i]*Qy[i]);
+}
+
+KERNEL void rapidity(unsigned n, cdp Qz, cdp QE, dp out) {
+  for (unsigned i=0; i<n; ++i)
+    out[i] = 0.5*std::log((QE[i] + Qz[i])/(QE[i] - Qz[i]));
+}
+
+const char* names[] {
+  "cos_theta", "cos_theta_hel", "cos_theta_GJ",
+  "pT", "y", "M"
+};
+
+}
+
+observable observable_from_name(const std::string& name) {
+  for (unsigned i=0; i<sizeof(names)/sizeof(*names); ++i)
+    if (name==names[i]) return observable(i);
+  if (name=="cos_theta_CS") return observable::cos_theta;
+  throw ivanp::error("unknown observable \"",name,'\"');
+}
+
+const char* observable_name(observable obs) noexcept {
+  return names[unsigned(obs)];
+}
+
+void higgs_jet_kinematics(
+  pair_block& p, const std::vector<observable>& obs
+) {
+  const unsigned n = p.size();
+  for (auto* v : { &p.Qx, &p.Qy, &p.Qz, &p.QE, &p.Q2,
+                   &p.mass, &p.lz, &p.lE, &p.l2 }) v->resize(n);
+  rest_frame(n,
+    p.Hx.data(), p.Hy.data(), p.Hz.data(), p.HE.data(),
+    p.jx.data(), p.jy.data(), p.jz.data(), p.jE.data(),
+    p.Qx.data(), p.Qy.data(), p.Qz.data(), p.QE.data(), p.Q2.data(),
+    p.mass.data(), p.lz.data(), p.lE.data(), p.l2.data());
+
+  const double *Qx = p.Qx.data(), *Qy = p.Qy.data(), *Qz = p.Qz.data(),
+               *QE = p.QE.data(), *Q2 = p.Q2.data(),
+               *lz = p.lz.data(), *lE = p.lE.data(), *l2 = p.l2.data();
+  p.obs.resize(obs.size());
+  for (unsigned k=0; k<obs.size(); ++k) {
+    auto& col = p.obs[k];
+    col.resize(n);
+    double* out = col.data();
+    switch (obs[k]) {
+      case observable::cos_theta:
+        cos_theta(n,Qz,QE,lz,lE,l2,out); break;
+      case observable::cos_theta_hel:
+        cos_theta_hel(n,Qx,Qy,Qz,Q2,lE,l2,out); break;
+      case observable::cos_theta_GJ:
+        cos_theta_GJ(n,Qz,QE,Q2,lz,lE,l2,out); break;
+      case observable::pT:
+        pT(n,Qx,Qy,out); break;
+      case observable::y:
+        rapidity(n,Qz,QE,out); break;
+      case observable::M:
+        col = p.mass; break;
+    }
+  }
+}
@@ -0,0 +1,133 @@
+#include "likelihood.hh"
+#include <cmath>
+#include <algorithm>
+#include "Legendre.hh"
+
+// Kernels are compiled for several instruction sets
+// and selected at load time
+#define KERNEL __attribute__((target_clones("avx512f","avx2","default")))
+
+legendre_coefs::legendre_coefs(const double* c)
+: c0(std::sqrt(
+    0.5 - (0.2*c[0]*c[0] + (1./9.)*c[1]*c[1] + (1./13.)*c[2]*c[2]) )),
+  c2r(c[0]*std::cos(c[3])), c2i(c[0]*std::sin(c[3])),
+  c4(c[1]), c6(c[2]),
+  c2(c[0]), cos_phi(std::cos(c[3])), sin_phi(std::sin(c[3])),
+  dc0{ -0.2*c[0]/c0, -(1./9.)*c[1]/c0, -(1./13.)*c[2]/c0 } { }
+
+namespace {
+
+using cdp = const double* __restrict;
+using dp  = double* __restrict;
+
+// Operations are in the same order as in the complex Legendre()
+KERNEL void kernel(
+  size_t n, double c0, double c2r, double c2i, double c4, double c6,
+  cdp p2, cdp p4, cdp p6, dp f
+) {
+  for (size_t i=0; i<n; ++i) {
+    const double re = c0 + c2r*p2[i] + c4*p4[i] + c6*p6[i];
+    const double im = c2i*p2[i];
+    f[i] = re*re + im*im;
+  }
+}
+
+// Weights and P2, P4, P6 of events from strided records
+KERNEL void basis(
+  size_t n, unsigned stride, cdp w, cdp x, dp ws, dp p2, dp p4, dp p6
+) {
+  for (size_t i=0; i<n; ++i) {
+    ws[i] = w[i*stride];
+    Legendre_basis(x[i*stride],p2[i],p4[i],p6[i]);
+  }
+}
+
+// Also w*re/f and w*im/f, from which the gradient is summed
+KERNEL void kernel_grad(
+  size_t n, double c0, double c2r, double c2i, double c4, double c6,
+  cdp w, cdp p2, cdp p4, cdp p6, dp f, dp a, dp b
+) {
+  for (size_t i=0; i<n; ++i) {
+    const double re = c0 + c2r*p2[i] + c4*p4[i] + c6*p6[i];
+    const double im = c2i*p2[i];
+    f[i] = re*re + im*im;
+    a[i] = w[i]*re/f[i];
+    b[i] = w[i]*im/f[i];
+  }
+}
+
+}
+
+void legendre_kernel(
+  const legendre_coefs& k, size_t n,
+  const double* p2, const double* p4, const double* p6, double* f
+) {
+  kernel(n,k.c0,k.c2r,k.c2i,k.c4,k.c6,p2,p4,p6,f);
+}
+
+// log does not vectorize without -ffast-math,
+// so f is computed in blocks by the kernel and the logs are summed after
+double legendre_logl(
+  const legendre_coefs& k, size_t n, const double* w,
+  const double* p2, const double* p4, const double* p6
+) {
+  constexpr size_t block = 256;
+  double f[block];
+  long double logl = 0.;
+  for (size_t a=0; a<n; a+=block) {
+    const size_t m = std::min(block,n-a);
+    kernel(m,k.c0,k.c2r,k.c2i,k.c4,k.c6,p2+a,p4+a,p6+a,f);
+    for (size_t i=0; i<m; ++i) logl += w[a+i]*std::log(f[i]);
+  }
+  return logl;
+}
+
+// d log(f) = 2 (re d re + im d im)/f, where
+//   d re = dc0 + cos(phi) P2 dc2 + P4 dc4 + P6 dc6 - c2 sin(phi) P2 dphi
+//   d im = sin(phi) P2 dc2 + c2 cos(phi) P2 dphi
+// so the gradient only needs 5 sums over the events
+double legendre_logl(
+  const legendre_coefs& k, size_t n, const double* w,
+  const double* p2, const double* p4, const double* p6, double* grad
+) {
+  constexpr size_t block = 256;
+  double f[block], a[block], b[block];
+  long double logl = 0.;
+  double s = 0, s2 = 0, s4 = 0, s6 = 0, t2 = 0;
+  for (size_t j=0; j<n; j+=block) {
+    const size_t m = std::min(block,n-j);
+    kernel_grad(m,k.c0,k.c2r,k.c2i,k.c4,k.c6,w+j,p2+j,p4+j,p6+j,f,a,b);
+    for (size_t i=0; i<m; ++i) {
+      logl += w[j+i]*std::log(f[i]);
+      s  += a[i];
+      s2 += a[i]*p2[j+i];
+      s4 += a[i]*p4[j+i];
+      s6 += a[i]*p6[j+i];
+      t2 += b[i]*p2[j+i];
+    }
+  }
+  grad[0] += 2.*(k.dc0[0]*s + k.cos_phi*s2 + k.sin_phi*t2);
+  grad[1] += 2.*(k.dc0[1]*s + s4);
+  grad[2] += 2.*(k.dc0[2]*s + s6);
+  grad[3] += 2.*k.c2*(k.cos_phi*t2 - k.sin_phi*s2);
+  return logl;
+}
+
+// The polynomials are computed in blocks, as in Legendre(x,c),
+// and passed to the same kernels
+double legendre_logl(
+  const legendre_coefs& k, size_t n, unsigned stride,
+  const double* w, const double* x, double* grad
+) {
+  constexpr size_t block = 256;
+  double ws[block], p2[block], p4[block], p6[block];
+  long double logl = 0.;
+  for (size_t j=0; j<n; j+=block) {
+    const size_t m = std::min(block,n-j);
+    basis(m,stride,w+j*stride,x+j*stride,ws,p2,p4,p6);
+    logl += grad
+      ? legendre_logl(k,m,ws,p2,p4,p6,grad)
+      : legendre_logl(k,m,ws,p2,p4,p6);
+  }
+  return logl;
+}
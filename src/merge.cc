@@ -0,0 +1,124 @@
+#include <iostream>
+#include <vector>
+#include <queue>
+#include <memory>
+#include <cstdio>
+
+#include "json.hpp"
+
+#include "ivanp/string.hh"
+#include "ivanp/program_options.hh"
+#include "ivanp/error.hh"
+
+#include "iftty.hh"
+#include "async_writer.hh"
+#include "dat_format.hh"
+
+using std::cout;
+using std::cerr;
+using std::endl;
+using ivanp::cat;
+
+// Put together the outputs of vars --shard i/N for one mass bin
+// or jet definition into the output of a full run
+// The shards must come from the same config, and all N must be given
+// Unsorted records are concatenated in shard order
+// Sorted records are merged, and records of equal value keep
+// the shard order, as the stable sort of a full run does
+
+int main(int argc, char* argv[]) {
+  std::vector<const char*> ifnames;
+  const char* ofname;
+
+  try {
+    using namespace ivanp::po;
+    if (program_options()
+      (ifnames,'i',"input dat files, one per shard",req(),pos())
+      (ofname,'o',"output dat file",req())
+      .parse(argc,argv,true)) return 0;
+  } catch (const std::exception& e) {
+    cerr << iftty("\033[31m",2) << e.what() << iftty("\033[0m",2) << endl;
+    return 1;
+  }
+  // ================================================================
+
+  const unsigned nshards = ifnames.size();
+  std::vector<std::unique_ptr<dat_file>> shards(nshards);
+  nlohmann::json info;
+  std::vector<std::string> fields;
+  const char* first = nullptr; // file the others are compared to
+
+  for (const char* name : ifnames) {
+    std::unique_ptr<dat_file> f(new dat_file(name));
+    auto j = nlohmann::json::parse(f->info());
+    const auto it = j.find("shard");
+    if (it==j.end()) throw ivanp::error(name," is not a shard");
+    const unsigned i = it->at(0), n = it->at(1);
+    if (n!=nshards || i>=n) throw ivanp::error(
+      name," is shard ",i,'/',n,", but ",nshards," shards are given");
+    if (shards[i]) throw ivanp::error("shard ",i," is given twice");
+    j.erase(it);
+
+    if (!first) {
+      first = name;
+      info = std::move(j);
+      fields = f->fields();
+    } else {
+      if (j!=info) throw ivanp::error(
+        "info of ",name," does not match ",first);
+      if (f->fields()!=fields) throw ivanp::error(
+        "fields of ",name," do not match ",first);
+    }
+    shards[i] = std::move(f);
+  }
+  const dat_file& f0 = *shards[0];
+  for (const auto& f : shards)
+    if (f->sort_field()!=f0.sort_field() ||
+        f->index_stride()!=f0.index_stride())
+      throw ivanp::error("shards are not sorted the same way");
+  const unsigned nf = fields.size();
+  const int sort_field = f0.sort_field();
+
+  // Write through a temporary file,
+  // so that a failed merge does not leave a truncated output
+  const std::string tmp = cat(ofname,".tmp");
+  async_writer writer;
+  dat_writer out;
+  out.open(writer,tmp,info.dump(),fields,
+    sort_field+1,sort_field < 0 ? 1024 : f0.index_stride());
+
+  if (sort_field < 0) {
+    for (const auto& f : shards) {
+      const double* r = f->records();
+      for (auto n=f->nevents(); n; --n, r+=nf) out(r);
+    }
+  } else {
+    // next record of each shard, smallest value first, then lowest shard
+    struct head {
+      const double *r, *end;
+      unsigned shard;
+    };
+    auto later = [sort_field](const head& a, const head& b){
+      const double x = a.r[sort_field], y = b.r[sort_field];
+      return x > y || (x == y && a.shard > b.shard);
+    };
+    std::priority_queue<head,std::vector<head>,decltype(later)> heads(later);
+    for (unsigned i=0; i<nshards; ++i) {
+      const double* r = shards[i]->records();
+      if (shards[i]->nevents())
+        heads.push({ r, r + shards[i]->nevents()*nf, i });
+    }
+    while (!heads.empty()) {
+      head h = heads.top();
+      heads.pop();
+      out(h.r);
+      if ((h.r += nf) != h.end) heads.push(h);
+    }
+  }
+  out.close();
+
+  if (std::rename(tmp.c_str(),ofname))
+    throw ivanp::error("cannot rename ",tmp," to ",ofname);
+  cout << iftty("\033[36m") << "Wrote " << iftty("\033[0m") << ofname
+       << " from " << nshards << " shards" << endl;
+}
@@ -1,10 +1,24 @@
 #include <iostream>
 #include <fstream>
-#include <functional>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <numeric>
+#include <algorithm>
+#include <limits>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
 
 #include <boost/optional.hpp>
 
+#include <TROOT.h>
 #include <TChain.h>
+#include <TFile.h>
 #include <TTreeReader.h>
 #include <TTreeReaderValue.h>
 #include <TTreeReaderArray.h>
@@ -18,10 +32,21 @@
 #include "ivanp/program_options.hh"
 #include "ivanp/timed_counter.hh"
 #include "ivanp/binner.hh"
+#include "ivanp/error.hh"
 
 #include "float_or_double_reader.hh"
+#include "particle_block.hh"
+#include "particle_cache.hh"
+#include "jet_cuts.hh"
+#include "kt_cluster.hh"
+#include "async_writer.hh"
+#include "lockfree_queue.hh"
+#include "dat_format.hh"
+#include "kinematics.hh"
+#include "manifest.hh"
+#include "input_files.hh"
+#include "write_file.hh"
 #include "vec4.hh"
-#include "event.hh"
 #include "glob.hh"
 #include "iftty.hh"
 
@@ -61,27 +86,815 @@ struct adl_serializer<fj::JetAlgorithm> {
 };
 }
 
-class mass_bin {
-  std::ofstream f;
+// Observables written after the weight in every record
+std::vector<observable> observables;
+
+// A record is the event weight followed by the observables
+using record_t = std::vector<double>;
+
+class mass_bin: public dat_writer {
+public:
+  Long64_t count() const noexcept { return nevents(); }
+  inline void operator()(const record_t& rec) {
+    dat_writer::operator()(rec.data());
+  }
+  // records stored one after another
+  inline void write(const std::vector<double>& recs) {
+    const unsigned n = nfields();
+    for (size_t i=0, size=recs.size(); i<size; i+=n)
+      dat_writer::operator()(recs.data()+i);
+  }
+};
+
+// Thread-local output, written out in entry order after the loop
+struct mass_bin_buffer: std::vector<double> {
+  Long64_t count() const noexcept { return size()/(observables.size()+1); }
+  inline void operator()(const record_t& rec) {
+    insert(end(),rec.begin(),rec.end());
+  }
+};
+
+// Unbinned output, sorted by mass after the loop
+// The mass is also appended to every record
+struct mass_events {
+  std::vector<double> recs, mass;
+  inline void operator()(double m, const record_t& rec) {
+    recs.insert(recs.end(),rec.begin(),rec.end());
+    recs.push_back(m);
+    mass.push_back(m);
+  }
+};
+
+template <typename Bin>
+using mass_binner = ivanp::binner<Bin, std::tuple<
+  ivanp::axis_spec<ivanp::container_axis<std::vector<double>&>,0,0> > >;
+
+// One set of mass bins per jet definition
+template <typename Bin>
+using mass_binners = std::vector<mass_binner<Bin>>;
+
+// Number of records in each output file, in the order of the files
+template <typename Bin>
+void count_records(const mass_binners<Bin>& outs, std::vector<Long64_t>& c) {
+  c.clear();
+  for (const auto& bins : outs)
+    for (const auto& bin : bins.bins()) c.push_back(bin.count());
+}
+void count_records(
+  const std::vector<mass_events>& outs, std::vector<Long64_t>& c
+) {
+  c.clear();
+  for (const auto& out : outs) c.push_back(out.mass.size());
+}
+
+// Remove all records, keeping the allocated buffers
+template <typename Bin>
+void clear_records(mass_binners<Bin>& outs) {
+  for (auto& bins : outs)
+    for (auto& bin : bins.bins()) bin.clear();
+}
+void clear_records(std::vector<mass_events>& outs) {
+  for (auto& out : outs) {
+    out.recs.clear();
+    out.mass.clear();
+  }
+}
+
+// Number of records written for each input file, [file][output]
+using file_counts = std::vector<std::vector<Long64_t>>;
+
+file_counts& operator+=(file_counts& a, const file_counts& b) {
+  for (unsigned i=0; i<b.size(); ++i) {
+    if (a[i].size() < b[i].size()) a[i].resize(b[i].size());
+    for (unsigned j=0; j<b[i].size(); ++j) a[i][j] += b[i][j];
+  }
+  return a;
+}
+
+struct input_chain {
+  const char* tree_name;
+  std::vector<std::string> names;
+  std::vector<Long64_t> nentries;
+};
+
+struct jet_def {
+  boost::optional<fj::JetDefinition> alg;
+  jet_cuts cuts;
+
+  jet_def() = default;
+  jet_def(const nlohmann::json& jet_info) {
+    if (jet_info.is_null()) return;
+    const auto& jet_alg_info = jet_info["alg"];
+    alg.emplace(
+      jet_alg_info[0].get<fj::JetAlgorithm>(),
+      jet_alg_info[1].get<double>());
+    const auto& jet_cuts_info = jet_info["cuts"];
+    if (!jet_cuts_info.is_null()) { // jet cuts ---------------------
+      for (auto it=jet_cuts_info.begin(); it!=jet_cuts_info.end(); ++it)
+        cuts.set(it.key(),it.value(),alg ? alg->R() : 0.);
+    }
+  }
+};
+
+// Split [begin,end) into at most n ranges, starting each one
+// at a cluster boundary of the tree that contains it
+std::vector<Long64_t> split_entries(
+  TChain& chain, Long64_t begin, Long64_t end, unsigned n
+) {
+  std::vector<Long64_t> edges { begin };
+  for (unsigned i=1; i<n; ++i) {
+    const Long64_t local = chain.LoadTree(begin + (end-begin)*i/n);
+    if (local < 0) break;
+    auto cluster = chain.GetTree()->GetClusterIterator(local);
+    const Long64_t edge = chain.GetChainOffset() + cluster.GetStartEntry();
+    if (edge > edges.back() && edge < end) edges.push_back(edge);
+  }
+  if (end > edges.back()) edges.push_back(end);
+  return edges;
+}
+
+// Events with at most native_max particles are clustered
+// with kt_clusterer instead of FastJet
+unsigned native_max = kt_clusterer::max_n;
+
+// Comparison of kt_clusterer with FastJet
+struct clustering_check {
+  Long64_t nevents = 0, nmismatch = 0;
+  double t_fastjet = 0, t_native = 0;
+
+  clustering_check& operator+=(const clustering_check& o) noexcept {
+    nevents += o.nevents;
+    nmismatch += o.nmismatch;
+    t_fastjet += o.t_fastjet;
+    t_native += o.t_native;
+    return *this;
+  }
+
+  // Compare jets, allowing for different order
+  static bool same(const jet_soa& a, const jet_soa& b) {
+    const unsigned n = a.size();
+    if (b.size()!=n) return false;
+    auto order = [](const jet_soa& jets) {
+      std::vector<unsigned> o(jets.size());
+      for (unsigned i=0; i<o.size(); ++i) o[i] = i;
+      std::sort(o.begin(),o.end(),[&](unsigned i, unsigned j){
+        return jets.E[i] > jets.E[j];
+      });
+      return o;
+    };
+    const auto oa = order(a), ob = order(b);
+    for (unsigned k=0; k<n; ++k) {
+      const unsigned i = oa[k], j = ob[k];
+      const double tol = 1e-9*(a.E[i] + b.E[j]);
+      if (std::abs(a.px[i]-b.px[j]) > tol ||
+          std::abs(a.py[i]-b.py[j]) > tol ||
+          std::abs(a.pz[i]-b.pz[j]) > tol ||
+          std::abs(a.E [i]-b.E [j]) > tol) return false;
+    }
+    return true;
+  }
+};
+boost::optional<clustering_check> validation;
+std::mutex validation_mutex;
+
+void print_validation() {
+  if (!validation) return;
+  const auto& v = *validation;
+  cout << iftty("\033[34m") << "Native clustering validation"
+       << iftty("\033[0m") << '\n'
+       << "  events compared: " << v.nevents << '\n'
+       << "  mismatched: " << v.nmismatch << '\n'
+       << "  FastJet: " << v.t_fastjet << " s\n"
+       << "  native:  " << v.t_native << " s\n"
+       << "  speedup: " << v.t_fastjet/v.t_native << endl;
+}
+
+// Time spent in each stage of the event loop, summed over threads,
+// and what went through it
+struct run_stats {
+  enum stage { read, extract, cluster, cuts, kinematics, write, nstages };
+  static const char* name(unsigned s) noexcept {
+    static const char* names[nstages] = {
+      "read", "extract", "cluster", "cuts", "kinematics", "write" };
+    return names[s];
+  }
+
+  double t[nstages] = { }; // seconds
+  Long64_t nevents = 0, bytes = 0;
+  std::vector<Long64_t> records; // written to each output
+
+  run_stats& operator+=(const run_stats& o) {
+    for (unsigned s=0; s<nstages; ++s) t[s] += o.t[s];
+    nevents += o.nevents;
+    bytes += o.bytes;
+    if (records.size() < o.records.size()) records.resize(o.records.size());
+    for (unsigned i=0; i<o.records.size(); ++i) records[i] += o.records[i];
+    return *this;
+  }
+
+  // One line summary, with the share of time of each stage
+  std::string summary(double wall) const {
+    double total = 0;
+    for (double x : t) total += x;
+    std::string str = cat(
+      nevents," events, ",Long64_t(nevents/wall)," events/s, ",
+      std::round(bytes/wall*1e-5)*0.1," MB/s");
+    if (total > 0) {
+      str += " |";
+      for (unsigned s=0; s<nstages; ++s)
+        str += cat(' ',name(s),' ',std::lround(100*t[s]/total),'%');
+    }
+    return str;
+  }
+};
+run_stats stats;
+std::mutex stats_mutex;
+
+// Stage times take a few clock reads per event and jet definition,
+// so they are only measured if asked for
+bool stage_timing = false;
+
+// The progress counter is not shown while stats are printed,
+// since both would write to the terminal
+bool show_progress = true;
+
+// Entry counter, showing progress with timed_counter if show_progress
+class progress_counter {
+  Long64_t i;
+  boost::optional<ivanp::timed_counter<Long64_t>> counter;
+
 public:
-  std::ofstream& open(const std::string& name) { f.open(name); return f; }
-  inline void operator()() {
-    f.write(reinterpret_cast<const char*>(&event),sizeof(event));
+  progress_counter(Long64_t n): progress_counter(0,n) { }
+  progress_counter(Long64_t a, Long64_t b): i(a) {
+    if (show_progress) counter.emplace(a,b);
+  }
+  progress_counter& operator++() {
+    ++i;
+    if (counter) ++*counter;
+    return *this;
+  }
+  operator Long64_t() const noexcept { return i; }
+};
+
+// Prints the stats every so many seconds, until stopped
+class stats_printer {
+  std::mutex m;
+  std::condition_variable cv;
+  bool done = false;
+  std::thread thread;
+
+public:
+  using clock = std::chrono::steady_clock;
+
+  stats_printer(unsigned every, clock::time_point start) {
+    if (!every) return;
+    thread = std::thread([=]{
+      std::unique_lock<std::mutex> lock(m);
+      while (!cv.wait_for(lock,std::chrono::seconds(every),[&]{
+        return done;
+      })) {
+        run_stats s;
+        { std::lock_guard<std::mutex> lock(stats_mutex);
+          s = stats;
+        }
+        const std::chrono::duration<double> wall = clock::now() - start;
+        cerr << iftty("\033[35m",2) << "Stats" << iftty("\033[0m",2)
+             << ": " << s.summary(wall.count()) << endl;
+      }
+    });
+  }
+  ~stats_printer() { stop(); }
+
+  void stop() {
+    if (!thread.joinable()) return;
+    { std::lock_guard<std::mutex> lock(m);
+      done = true;
+    }
+    cv.notify_one();
+    thread.join();
+  }
+};
+
+// Per-thread state for clustering jets and computing observables
+// Particles of every event are read once and clustered
+// for each jet definition
+// Buffers are reused between events, so that nothing is allocated
+// per event outside of FastJet
+class event_processor {
+  const std::vector<jet_def>& jdefs;
+  std::vector<fj::PseudoJet> particles;
+  bool particles_ready;
+  jet_soa jets, native_jets;
+  std::vector<pair_block> pairs; // one per jet definition
+  record_t record;
+  clustering_check check;
+  run_stats local_stats; // added to stats after every block
+  std::vector<Long64_t> before, after;
+
+  using clock = std::chrono::steady_clock;
+  using sec = std::chrono::duration<double>;
+
+  // Start of a timed stage
+  static clock::time_point start() {
+    return stage_timing ? clock::now() : clock::time_point();
+  }
+  // Add the time since t to stage s and restart t
+  void lap(run_stats::stage s, clock::time_point& t) {
+    if (!stage_timing) return;
+    const auto now = clock::now();
+    local_stats.t[s] += sec(now-t).count();
+    t = now;
+  }
+
+  template <typename Block>
+  void cluster_fastjet(const jet_def& jdef, const Block& block, unsigned e) {
+    if (!particles_ready) {
+      particles.clear();
+      for (auto i=block.offsets[e], n=block.offsets[e+1]; i<n; ++i)
+        particles.emplace_back(
+          block.px[i],block.py[i],block.pz[i],block.E[i]);
+      particles_ready = true;
+    }
+    // inclusive jets, read directly from the clustering history
+    const fj::ClusterSequence cs(particles,*jdef.alg);
+    const auto& history = cs.history();
+    for (const auto& h : history) {
+      if (h.parent2!=fj::ClusterSequence::BeamJet) continue;
+      const auto& j = cs.jets()[history[h.parent1].jetp_index];
+      jets.push_back(j.px(),j.py(),j.pz(),j.E());
+    }
+  }
+
+  // Run both clusterers, time them, and compare the jets
+  // FastJet jets are used for the output
+  template <typename Block>
+  void validate(const jet_def& jdef, const Block& block, unsigned e) {
+    const auto first = block.offsets[e], last = block.offsets[e+1];
+
+    auto t0 = clock::now();
+    native_jets.clear();
+    kt_clusterer(*jdef.alg)(
+      block.px,block.py,block.pz,block.E,first,last,native_jets);
+    auto t1 = clock::now();
+    cluster_fastjet(jdef,block,e);
+    auto t2 = clock::now();
+
+    check.t_native += sec(t1-t0).count();
+    check.t_fastjet += sec(t2-t1).count();
+    ++check.nevents;
+    if (!clustering_check::same(jets,native_jets)) ++check.nmismatch;
+  }
+
+  // Leading jet for the given definition
+  // Returns false if no jet passes the cuts
+  template <typename Block>
+  bool select_jet(
+    const jet_def& jdef, const Block& block, unsigned e, vec4& jet
+  ) {
+    jets.clear();
+    auto t = start();
+    const auto first = block.offsets[e], last = block.offsets[e+1];
+    const unsigned np = last - first;
+    if (jdef.alg && np > 1) {
+      if (np > native_max) cluster_fastjet(jdef,block,e);
+      else if (validation) validate(jdef,block,e);
+      else kt_clusterer(*jdef.alg)(
+        block.px,block.py,block.pz,block.E,first,last,jets);
+    } else {
+      for (auto i=first; i<last; ++i)
+        jets.push_back(block.px[i],block.py[i],block.pz[i],block.E[i]);
+    }
+    lap(run_stats::cluster,t);
+    const int lead = jdef.cuts.leading(jets);
+    lap(run_stats::cuts,t);
+    if (lead < 0) return false;
+    jet = { jets.px[lead], jets.py[lead], jets.pz[lead], jets.E[lead] };
+    return true;
+  }
+
+public:
+  event_processor(const std::vector<jet_def>& jdefs): jdefs(jdefs) { }
+  ~event_processor() {
+    if (!validation) return;
+    std::lock_guard<std::mutex> lock(validation_mutex);
+    *validation += check;
+  }
+
+  // Add the reading time of the next block
+  void read(const block_read_stats& s) noexcept {
+    local_stats.t[run_stats::read] += s.t_read;
+    local_stats.t[run_stats::extract] += s.t_extract;
+    local_stats.bytes += s.bytes;
+  }
+
+  // Block is a particle_block or a particle_view
+  // Out is a mass_binner or mass_events, one per jet definition
+  // Selected Higgs + jet pairs are collected for the whole block,
+  // and the observables are computed for all of them at once
+  template <typename Block, typename Out, typename Tick>
+  void operator()(const Block& block, std::vector<Out>& outs, Tick& tick) {
+    const unsigned nd = jdefs.size();
+    pairs.resize(nd);
+    for (auto& p : pairs) p.clear();
+
+    for (unsigned e=0, ne=block.size(); e<ne; ++e) {
+      tick();
+      particles_ready = false;
+      for (unsigned d=0; d<nd; ++d) {
+        vec4 jet;
+        if (!select_jet(jdefs[d],block,e,jet)) continue;
+        pairs[d].push_back(block.higgs[e],jet,block.weight[e]);
+      }
+    }
+
+    const unsigned nobs = observables.size();
+    record.resize(nobs+1);
+    count_records(outs,before);
+    auto t = start();
+    for (unsigned d=0; d<nd; ++d) {
+      auto& p = pairs[d];
+      higgs_jet_kinematics(p,observables);
+      lap(run_stats::kinematics,t);
+      for (unsigned i=0, n=p.size(); i<n; ++i) {
+        record[0] = p.weight[i];
+        for (unsigned k=0; k<nobs; ++k) record[k+1] = p.obs[k][i];
+        outs[d](p.mass[i],record);
+      }
+      lap(run_stats::write,t);
+    }
+    count_records(outs,after);
+
+    local_stats.nevents += block.size();
+    local_stats.records.resize(after.size());
+    for (unsigned i=0; i<after.size(); ++i)
+      local_stats.records[i] += after[i] - before[i];
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    stats += local_stats;
+    local_stats = { };
+  }
+};
+
+// Events are processed in blocks of at most this many,
+// which bounds the memory held for a block
+constexpr Long64_t max_block_size = 1 << 16;
+
+// Read entries [begin,end) of a single tree and pass them to f
+// in blocks, one cluster at a time
+// T and W are the types of the momentum and weight branches
+template <typename T, typename W, typename F>
+void tree_loop(TTree* tree, Long64_t begin, Long64_t end, F& f) {
+  particle_block_reader<T,W> read(tree);
+  read.timed = stage_timing;
+  particle_block<T> block;
+
+  auto cluster = tree->GetClusterIterator(begin);
+  cluster.Next(); // go to the cluster containing begin
+  for (Long64_t first=begin; first<end; ) {
+    while (cluster.GetNextEntry() <= first) cluster.Next();
+    const Long64_t last = std::min({
+      cluster.GetNextEntry(), end, first + max_block_size });
+
+    read(first,last,block);
+    f(block,read.stats);
+    first = last;
+  }
+}
+
+// Read entries [begin,end) of the input chain in blocks
+// f is called with each block, the index of its file,
+// and the block_read_stats of reading it
+// f may swap the block with another one, which is cleared
+// before it is read into
+// Every call opens its own files and owns its readers,
+// so that several calls can run concurrently
+// Branch types are resolved once per file
+template <typename F>
+void read_blocks(
+  const input_chain& in, Long64_t begin, Long64_t end, F&& f
+) {
+  Long64_t first = 0;
+  for (unsigned i=0, n=in.names.size(); i<n && first<end; ++i) {
+    const Long64_t last = first + in.nentries[i];
+    if (last > begin) {
+      const char* name = in.names[i].c_str();
+      TFile file(name);
+      if (file.IsZombie()) throw ivanp::error("cannot open file ",name);
+      TTree* tree = nullptr;
+      file.GetObject(in.tree_name,tree);
+      if (!tree) throw ivanp::error("no tree ",in.tree_name," in ",name);
+
+      const Long64_t a = std::max(begin,first) - first;
+      const Long64_t b = std::min(end,last) - first;
+      float_or_double(branches_are_double(tree,{"px","py","pz","E"}),
+      [&](auto p){
+        float_or_double(branch_is_double(tree,"weight2"), [&](auto w){
+          auto g = [&](auto& block, const block_read_stats& s){
+            f(block,i,s);
+          };
+          tree_loop<decltype(p),decltype(w)>(tree,a,b,g);
+        });
+      });
+    }
+    first = last;
+  }
+}
+
+// Process entries [begin,end) of the input chain
+// Records written for each file are added to counts
+template <typename Out, typename Tick>
+void event_loop(
+  const input_chain& in, Long64_t begin, Long64_t end,
+  const std::vector<jet_def>& jdefs, std::vector<Out>& outs,
+  file_counts& counts, Tick&& tick
+) {
+  event_processor proc(jdefs);
+  std::vector<Long64_t> before, after;
+  read_blocks(in,begin,end,[&](
+    const auto& block, unsigned file, const block_read_stats& s
+  ){
+    count_records(outs,before);
+    proc.read(s);
+    proc(block,outs,tick);
+    count_records(outs,after);
+    auto& c = counts[file];
+    c.resize(after.size());
+    for (unsigned i=0; i<after.size(); ++i) c[i] += after[i] - before[i];
+  });
+}
+
+// Process events [begin,end) of the particle cache, in blocks
+// The cache does not know the input files, so counts are not filled
+template <typename Out, typename Tick>
+void event_loop(
+  const particle_cache& cache, Long64_t begin, Long64_t end,
+  const std::vector<jet_def>& jdefs, std::vector<Out>& outs,
+  file_counts&, Tick&& tick
+) {
+  event_processor proc(jdefs);
+  float_or_double(cache.is_double(), [&](auto p){
+    for (Long64_t first=begin; first<end; first+=max_block_size)
+      proc(cache.view<decltype(p)>(
+        first,std::min(end,first+max_block_size)),outs,tick);
+  });
+}
+
+// Pipeline =========================================================
+// A decode thread reads blocks of entries, a pool of workers clusters
+// jets and computes observables, and the calling thread passes the
+// outputs of the blocks to consume in entry order
+// Batches go around through lock-free queues, from spare to work to
+// done and back to spare, so that their buffers are reused, and there
+// are a few per worker, which bounds memory use
+
+template <typename Out>
+struct pipeline_batch {
+  size_t seq; // position in entry order
+  unsigned file;
+  bool is_double;
+  particle_block<float> fblock;
+  particle_block<double> dblock;
+  block_read_stats stats;
+  Out out;
+
+  pipeline_batch(Out out): out(std::move(out)) { }
+
+  particle_block<float >& block(float ) noexcept { return fblock; }
+  particle_block<double>& block(double) noexcept { return dblock; }
+  unsigned size() const noexcept {
+    return is_double ? dblock.size() : fblock.size();
   }
 };
 
+// Process entries [begin,end) of the input chain with nworkers workers
+// Records written for each file are added to counts
+// Outs are made by make_out for every batch, and cleared
+// after consume, which may swap the Out with another one from make_out
+template <typename MakeOut, typename Consume>
+void pipeline_loop(
+  const input_chain& in, Long64_t begin, Long64_t end,
+  const std::vector<jet_def>& jdefs, unsigned nworkers,
+  MakeOut make_out, Consume&& consume, file_counts& counts
+) {
+  using batch = pipeline_batch<decltype(make_out())>;
+  const unsigned nbatches = 4*nworkers;
+  std::vector<std::unique_ptr<batch>> pool;
+  // the work queue also holds a null batch for every worker at the end
+  mpmc_queue<batch*> spare(nbatches), work(nbatches+nworkers), done(nbatches);
+  for (unsigned i=0; i<nbatches; ++i) {
+    pool.emplace_back(new batch(make_out()));
+    spare.push(pool.back().get());
+  }
+
+  // The first exception stops all stages
+  std::atomic<bool> failed(false);
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  auto fail = [&]{
+    std::lock_guard<std::mutex> lock(error_mutex);
+    if (!error) error = std::current_exception();
+    failed = true;
+  };
+  // Return false if the pipeline failed while waiting
+  auto pop = [&](mpmc_queue<batch*>& q, batch*& b) {
+    for (queue_backoff wait; !q.pop(b); wait()) if (failed) return false;
+    return true;
+  };
+  auto push = [&](mpmc_queue<batch*>& q, batch* b) {
+    for (queue_backoff wait; !q.push(std::move(b)); wait())
+      if (failed) return false;
+    return true;
+  };
+
+  std::atomic<size_t> nread(0);
+  std::atomic<bool> read_done(false);
+  std::thread decoder([&]{
+    try {
+      size_t seq = 0;
+      read_blocks(in,begin,end,[&](
+        auto& block, unsigned file, const block_read_stats& s
+      ){
+        using T = std::decay_t<decltype(block.px[0])>;
+        batch* b;
+        if (!pop(spare,b)) throw std::runtime_error("pipeline stopped");
+        std::swap(b->block(T()),block);
+        b->is_double = std::is_same<T,double>::value;
+        b->seq = seq++;
+        b->file = file;
+        b->stats = s;
+        push(work,b);
+      });
+      nread = seq;
+    } catch (...) { fail(); }
+    read_done = true;
+    for (unsigned i=0; i<nworkers; ++i) push(work,nullptr);
+  });
+
+  std::vector<std::thread> workers;
+  workers.reserve(nworkers);
+  for (unsigned i=0; i<nworkers; ++i)
+    workers.emplace_back([&]{
+      try {
+        event_processor proc(jdefs);
+        auto tick = []{ };
+        for (batch* b; pop(work,b) && b; ) {
+          proc.read(b->stats);
+          if (b->is_double) proc(b->dblock,b->out,tick);
+          else proc(b->fblock,b->out,tick);
+          push(done,b);
+        }
+      } catch (...) { fail(); }
+    });
+
+  // Batches that arrive early wait in ready, at seq % nbatches,
+  // since at most nbatches are in flight
+  try {
+    std::vector<batch*> ready(nbatches,nullptr);
+    std::vector<Long64_t> c;
+    progress_counter ent(begin,end);
+    queue_backoff wait;
+    for (size_t next=0; !(read_done && next==nread) && !failed; ) {
+      batch* b;
+      if (!done.pop(b)) { wait(); continue; }
+      wait.reset();
+      ready[b->seq % nbatches] = b;
+      while ((b = ready[next % nbatches]) && b->seq == next) {
+        ready[next % nbatches] = nullptr;
+        count_records(b->out,c);
+        auto& fc = counts[b->file];
+        fc.resize(c.size());
+        for (unsigned i=0; i<c.size(); ++i) fc[i] += c[i];
+        consume(b->out);
+        for (unsigned i=b->size(); i; --i) ++ent;
+        clear_records(b->out);
+        ++next;
+        push(spare,b);
+      }
+    }
+  } catch (...) { fail(); }
+
+  decoder.join();
+  for (auto& worker : workers) worker.join();
+  if (error) std::rethrow_exception(error);
+}
+
+// The cache is used if it was made from the same list of files
+// and written after all of them
+bool cache_is_fresh(
+  const char* name, const std::string& cache_info, const input_chain& in
+) {
+  struct stat st;
+  if (::stat(name,&st)) return false;
+  for (const auto& f : in.names) {
+    struct stat fst;
+    if (::stat(f.c_str(),&fst) || fst.st_mtime >= st.st_mtime) return false;
+  }
+  try {
+    return particle_cache(name).info() == cache_info;
+  } catch (const std::exception& e) {
+    cerr << iftty("\033[33m",2) << e.what() << iftty("\033[0m",2) << endl;
+    return false;
+  }
+}
+
+// Checkpoints ======================================================
+// A serial run with binned outputs can save its state every so many
+// entries, after syncing the outputs to disk, so that a killed run
+// continues from the last checkpoint and produces the same outputs
+// as an uninterrupted one
+
+nlohmann::json checkpoint_inputs(const manifest& m) {
+  auto j = nlohmann::json::array();
+  for (const auto& f : m.files) j.push_back({ f.path, f.size, f.mtime });
+  return j;
+}
+
+nlohmann::json state_to_json(const dat_writer::state& st) {
+  const auto& f = st.footer;
+  return {
+    {"size",st.size}, {"nevents",f.nevents},
+    {"sumw",f.sumw}, {"sumw2",f.sumw2},
+    {"x_min",f.x_min}, {"x_max",f.x_max} // infinite values become null
+  };
+}
+dat_writer::state state_from_json(const nlohmann::json& j) {
+  constexpr double inf = std::numeric_limits<double>::infinity();
+  dat_writer::state st { };
+  auto& f = st.footer;
+  st.size = j.at("size");
+  f.nevents = j.at("nevents");
+  f.sumw = j.at("sumw");
+  f.sumw2 = j.at("sumw2");
+  f.x_min = j.at("x_min").is_null() ?  inf : j.at("x_min").get<double>();
+  f.x_max = j.at("x_max").is_null() ? -inf : j.at("x_max").get<double>();
+  std::memcpy(f.magic,dat_magic,sizeof(f.magic));
+  return st;
+}
+
+// Synced before it replaces the old one
+void write_checkpoint(const std::string& name, const nlohmann::json& j) {
+  write_file(name,j.dump()+'\n',true);
+}
+
 int main(int argc, char* argv[]) {
   const char *ifname, *ofname;
   const char *tree_name = "t3";
   std::vector<double> mass_edges;
+  unsigned nthreads = 1;
+  const char *cache_name = nullptr;
+  bool cache_double = false;
+  bool validate = false;
+  bool mass_index = false;
+  bool incremental = false;
+  Long64_t checkpoint_every = 0;
+  unsigned io_threads = 16;
+  const char *entries_cache_name = nullptr;
+  const char *shard_arg = nullptr;
+  unsigned stats_every = 0;
+  unsigned npipeline = 0;
 
   try {
     using namespace ivanp::po;
     if (program_options()
       (ifname,'i',"input JSON config file",req(),pos())
       (ofname,'o',"output file name prefix",req())
-      (mass_edges,'b',"mass binning",req())
+      (mass_edges,'b',"mass binning")
+      (mass_index,"--mass-index",
+       "write unbinned events with their mass into one file\n"
+       "per jet definition, sorted and indexed by mass")
       (tree_name,{"-t","--tree"},cat("input TTree name [",tree_name,']'))
+      (nthreads,{"-j","--threads"},cat("number of threads [",nthreads,']'))
+      (cache_name,"--cache","particle cache file, made if out of date")
+      (cache_double,"--cache-double","store momenta as doubles in the cache")
+      (native_max,"--native",cat(
+        "max multiplicity for native clustering [",native_max,"]\n"
+        "larger events are clustered with FastJet, 0 - always FastJet"))
+      (validate,"--validate-clustering",
+       "compare native clustering with FastJet")
+      (incremental,"--incremental",
+       "process only input files that changed since the last run\n"
+       "and reuse the rest from the existing outputs")
+      (checkpoint_every,"--checkpoint",
+       "save a checkpoint every this many entries\n"
+       "and resume from the last one, if any\n"
+       "only for serial runs with binned outputs")
+      (io_threads,"--io-threads",cat(
+        "threads for finding and opening input files [",io_threads,']'))
+      (entries_cache_name,"--entries-cache",
+       "file of input entry counts, reused for unchanged files")
+      (shard_arg,"--shard",
+       "process only part i/N of the entries, for i from 0 to N-1\n"
+       "concatenating the shards in order with merge gives\n"
+       "the output of a full run")
+      (npipeline,"--pipeline",
+       "run as a pipeline of a reading thread, this many\n"
+       "clustering threads, and a writing thread\n"
+       "output is the same as from a serial run")
+      (stats_every,"--stats-every",
+       "print the throughput and the share of time of each stage\n"
+       "every this many seconds, instead of the progress counter")
+      (stage_timing,"--stage-times",
+       "measure the time spent in each stage of the event loop\n"
+       "costs a few clock reads per event, implied by --stats-every")
       .parse(argc,argv,true)) return 0;
   } catch (const std::exception& e) {
     cerr << iftty("\033[31m",2) << e.what() << iftty("\033[0m",2) << endl;
@@ -89,130 +902,630 @@ int main(int argc, char* argv[]) {
   }
   // ================================================================
 
+  if (!mass_index && mass_edges.size() < 2) {
+    cerr << iftty("\033[31m",2) << "mass binning (-b) or --mass-index"
+            " is required" << iftty("\033[0m",2) << endl;
+    return 1;
+  }
+  if (incremental && cache_name) {
+    cerr << iftty("\033[31m",2) << "--incremental cannot be used with"
+            " --cache" << iftty("\033[0m",2) << endl;
+    return 1;
+  }
+  if (checkpoint_every && (mass_index || nthreads > 1)) {
+    cerr << iftty("\033[31m",2) << "--checkpoint requires a single thread"
+            " and binned outputs" << iftty("\033[0m",2) << endl;
+    return 1;
+  }
+  if (stats_every) {
+    stage_timing = true;
+    show_progress = false;
+  }
+
+  unsigned shard = 0, nshards = 0;
+  if (shard_arg) {
+    char* end;
+    shard = std::strtoul(shard_arg,&end,10);
+    if (*end=='/') nshards = std::strtoul(end+1,&end,10);
+    if (*end || !(shard < nshards)) {
+      cerr << iftty("\033[31m",2) << "bad shard \"" << shard_arg
+           << '\"' << iftty("\033[0m",2) << endl;
+      return 1;
+    }
+    if (incremental) {
+      cerr << iftty("\033[31m",2) << "--incremental cannot be used with"
+              " --shard" << iftty("\033[0m",2) << endl;
+      return 1;
+    }
+  }
+  if (npipeline && (cache_name || checkpoint_every || nthreads > 1)) {
+    cerr << iftty("\033[31m",2) << "--pipeline cannot be used with"
+            " --cache, --checkpoint, or --threads" << iftty("\033[0m",2)
+         << endl;
+    return 1;
+  }
+  if (native_max > kt_clusterer::max_n) native_max = kt_clusterer::max_n;
+  if (validate) validation.emplace();
+
   nlohmann::json info;
   std::ifstream(ifname) >> info;
 
-  std::vector<std::string> ifnames;
-  for (const std::string& f : info["files"]) {
-    auto fs = ivanp::glob(f);
-    if (fs.empty())
-      throw std::runtime_error(cat("glob \"",f,"\" matched no files"));
-    ifnames.insert(
-      ifnames.end(),
-      std::make_move_iterator(fs.begin()),
-      std::make_move_iterator(fs.end()));
+  if (!io_threads) io_threads = 1;
+
+  input_chain in { tree_name };
+  {
+    const auto patterns = info["files"].get<std::vector<std::string>>();
+    auto lists = ivanp::glob(patterns,io_threads);
+    for (unsigned i=0; i<patterns.size(); ++i) {
+      if (lists[i].empty()) throw std::runtime_error(
+        cat("glob \"",patterns[i],"\" matched no files"));
+      in.names.insert(
+        in.names.end(),
+        std::make_move_iterator(lists[i].begin()),
+        std::make_move_iterator(lists[i].end()));
+    }
+  }
+  info["files"] = in.names;
+  if (nshards) info["shard"] = { shard, nshards };
+  const unsigned nfiles = in.names.size();
+  auto inputs = stat_inputs(in.names,io_threads);
+
+  // Manifest =======================================================
+  // Outputs depend on the config, the options, and the input files
+  manifest cur;
+  cur.config = info;
+  cur.config.erase("files");
+  cur.config["tree"] = tree_name;
+  cur.config["prefix"] = ofname;
+  cur.config["bins"] = mass_edges;
+  cur.config["mass_index"] = mass_index;
+  for (const auto& f : inputs)
+    cur.files.push_back({ f.path, f.size, f.mtime });
+
+  // reused[i] is the index in the old manifest of input file i,
+  // or -1 if the file has to be processed
+  const std::string manifest_name = cat(ofname,".manifest.json");
+  manifest old;
+  std::vector<int> reused(nfiles,-1);
+  if (incremental && old.load(manifest_name) && old.config==cur.config) {
+    for (unsigned i=0; i<nfiles; ++i)
+      for (unsigned j=0; j<old.files.size(); ++j)
+        if (cur.files[i].same_input(old.files[j])) { reused[i] = j; break; }
+    // sorted outputs cannot be split by file,
+    // so they can only be reused if files were only added
+    if (mass_index) {
+      bool appended = old.files.size() <= nfiles;
+      for (unsigned j=0; appended && j<old.files.size(); ++j)
+        appended = (reused[j] == int(j));
+      if (!appended || std::count(reused.begin(),reused.end(),-1)
+                       + old.files.size() != nfiles)
+        std::fill(reused.begin(),reused.end(),-1);
+    }
+  }
+  const unsigned nreused = nfiles - std::count(reused.begin(),reused.end(),-1);
+  const bool reuse = nreused;
+  if (incremental) {
+    cout << iftty("\033[34m") << "Incremental run" << iftty("\033[0m")
+         << ": reusing " << nreused << " of " << nfiles << " input files"
+         << '\n' << endl;
+  }
+
+  const std::string cache_info =
+    nlohmann::json({{"tree",tree_name},{"files",in.names}}).dump();
+  std::unique_ptr<particle_cache> cache;
+  if (cache_name && cache_is_fresh(cache_name,cache_info,in)) {
+    cout << iftty("\033[34m") << "Particle cache" << iftty("\033[0m")
+         << ": " << cache_name << '\n' << endl;
+    cache.reset(new particle_cache(cache_name));
+  }
+
+  // Resume from a checkpoint of the same job
+  // Checkpoints are not used when merging with old outputs
+  const std::string checkpoint_name = cat(ofname,".checkpoint.json");
+  if (reuse && checkpoint_every) {
+    cout << "Checkpoints are not used in incremental runs" << endl;
+    checkpoint_every = 0;
+  }
+  nlohmann::json checkpoint;
+  if (checkpoint_every) {
+    std::ifstream f(checkpoint_name);
+    if (f) {
+      f >> checkpoint;
+      if (checkpoint.at("config")==cur.config &&
+          checkpoint.at("inputs")==checkpoint_inputs(cur)) {
+        cout << iftty("\033[34m") << "Resuming" << iftty("\033[0m")
+             << " from entry " << checkpoint.at("entry") << '\n' << endl;
+      } else checkpoint = nullptr;
+    }
   }
-  info["files"] = ifnames;
+  const bool resume = !checkpoint.is_null();
 
   // Open input ntuples root file ===================================
   TChain chain(tree_name);
-  cout << iftty("\033[34m") << "Input ntuples" << iftty("\033[0m") << endl;
-  for (const std::string& name : ifnames) {
-    if (!chain.Add(name.c_str(),0)) return 1;
-    cout << "  " << name << endl;
+  if (!cache) {
+    // entries of reused files are known from the manifest,
+    // the rest are read concurrently, unless they are in the entries cache
+    entries_cache entries(entries_cache_name,tree_name);
+    for (unsigned i=0; i<nfiles; ++i)
+      if (reused[i] >= 0) inputs[i].entries = old.files[reused[i]].entries;
+    count_entries(inputs,tree_name,entries,io_threads);
+    entries.save();
+
+    // the chain is given the entries, so it does not open the files
+    // files without entries are not added, since a TChain
+    // takes a count of 0 to mean that it is not known
+    cout << iftty("\033[34m") << "Input ntuples" << iftty("\033[0m") << endl;
+    in.nentries.reserve(nfiles);
+    for (const auto& f : inputs) {
+      in.nentries.push_back(f.entries);
+      if (f.entries && !chain.Add(f.path.c_str(),f.entries)) return 1;
+      cout << "  " << f.path << endl;
+    }
+    cout << endl;
   }
-  cout << endl;
 
-  // Set up branches for reading
-  TTreeReader reader(&chain);
+  // Convert ntuples to particle cache ==============================
+  if (cache_name && !cache) {
+    cout << iftty("\033[34m") << "Writing particle cache"
+         << iftty("\033[0m") << ": " << cache_name << endl;
+    float_or_double(cache_double, [&](auto p){
+      particle_cache_writer<decltype(p)> write(cache_name,cache_info);
+      ivanp::timed_counter<Long64_t> ent(chain.GetEntries());
+      read_blocks(in,0,chain.GetEntries(),
+      [&](const auto& block, unsigned, const block_read_stats&){
+        write(block);
+        for (unsigned i=block.size(); i; --i) ++ent;
+      });
+      write.close();
+    });
+    cout << endl;
+    cache.reset(new particle_cache(cache_name));
+  }
 
-  TTreeReaderValue<Int_t> _nparticle(reader,"nparticle");
-  TTreeReaderArray<Int_t> _kf(reader,"kf");
+  // Only files that are not reused are processed
+  input_chain todo { tree_name };
+  for (unsigned i=0; i<nfiles && reuse; ++i) {
+    if (reused[i] >= 0) continue;
+    todo.names.push_back(in.names[i]);
+    todo.nentries.push_back(in.nentries[i]);
+  }
+  const input_chain& src = reuse ? todo : in;
 
-  float_or_double_array_reader _px(reader,"px");
-  float_or_double_array_reader _py(reader,"py");
-  float_or_double_array_reader _pz(reader,"pz");
-  float_or_double_array_reader _E (reader,"E" );
-  float_or_double_value_reader _weight(reader,"weight2");
+  const Long64_t nent = cache ? cache->nevents()
+    : std::accumulate(src.nentries.begin(),src.nentries.end(),Long64_t(0));
 
-  ivanp::binner<mass_bin, std::tuple<
-    ivanp::axis_spec<ivanp::container_axis<decltype(mass_edges)&>,0,0> >
-  > files(mass_edges);
+  // A shard is a contiguous range of entries,
+  // so that the shards in order hold the records of a full run
+  Long64_t first = 0, last = nent;
+  if (nshards) {
+    first = nent*shard/nshards;
+    last  = nent*(shard+1)/nshards;
+    cout << iftty("\033[34m") << "Shard " << shard << '/' << nshards
+         << iftty("\033[0m") << ": entries " << first << " to " << last
+         << '\n' << endl;
+  }
+
+  // Jet definitions ================================================
+  // "jet" can be a single definition or an array of definitions
+  // Each definition gets its own set of output files
+  const auto jet_it = info.find("jet");
+  const nlohmann::json jet_info =
+    jet_it!=info.end() ? *jet_it : nlohmann::json();
+  const bool multi_jet = jet_info.is_array();
+  std::vector<nlohmann::json> jet_infos;
+  if (multi_jet) jet_infos.assign(jet_info.begin(),jet_info.end());
+  else jet_infos.push_back(jet_info);
 
-  for (unsigned i=0, n=files.nbins(); i<n; ++i) {
-    auto& f = files.bins()[i].open(
-      cat(ofname,'_',mass_edges[i],'-',mass_edges[i+1],".dat"));
+  std::vector<jet_def> jdefs(jet_infos.begin(),jet_infos.end());
+  const unsigned ndefs = jdefs.size();
 
-    info["M"] = { mass_edges[i], mass_edges[i+1] };
-    f << info << endl;
+  bool banner = true;
+  for (const auto& jdef : jdefs) {
+    if (!jdef.alg) continue;
+    if (banner) {
+      fastjet::ClusterSequence::print_banner(); // get it out of the way
+      banner = false;
+    }
+    cout << jdef.alg->description() << endl;
   }
+  if (!banner) cout << endl;
 
-  const auto& jet_info = info["jet"];
-  boost::optional<fj::JetDefinition> jet_alg;
-  std::vector<std::function<bool(fj::PseudoJet)>> jet_cuts;
+  // Observables ====================================================
+  // "observables" lists the columns written after the weight,
+  // cos_theta if not given
+  // Fields are named as in the config, which may use an alias
+  std::vector<std::string> fields { "weight" };
+  const auto obs_it = info.find("observables");
+  if (obs_it==info.end()) {
+    observables = { observable::cos_theta };
+    fields.push_back(observable_name(observable::cos_theta));
+  } else for (const auto& name : *obs_it) {
+    fields.push_back(name.get<std::string>());
+    observables.push_back(observable_from_name(fields.back()));
+  }
+  std::vector<std::string> out_infos;
 
-  if (!jet_info.is_null()) {
-    const auto& jet_alg_info = jet_info["alg"];
-    jet_alg.emplace(
-      jet_alg_info[0].get<fj::JetAlgorithm>(),
-      jet_alg_info[1].get<double>());
-    const auto& jet_cuts_info = jet_info["cuts"];
-    if (!jet_cuts_info.is_null()) { // jet cuts ---------------------
-      for (auto it=jet_cuts_info.begin(); it!=jet_cuts_info.end(); ++it) {
-        const double val = it.value();
-        const auto&  var = it.key();
-        if (var=="pt") jet_cuts.emplace_back([=](const auto& jet){
-            return jet.pt() < val;
-          }); else
-        if (var=="eta") jet_cuts.emplace_back([=](const auto& jet){
-            return jet.eta() > val;
-          }); else
-        if (var=="x") jet_cuts.emplace_back([=,R=jet_alg->R()](const auto& jet){
-            return (jet.m()/(R*jet.pt())) < val;
-          });
-      }
+  // Output files ===================================================
+  // Records are written by a background thread
+  // The writer must outlive the files
+  async_writer writer;
+
+  // Names and headers of the output files
+  // One file per mass bin and jet definition,
+  // or one per jet definition with --mass-index
+  for (unsigned d=0; d<ndefs; ++d) {
+    std::string prefix = ofname;
+    if (multi_jet) {
+      prefix += '_' + jet_infos[d].value("name",std::to_string(d));
+      info["jet"] = jet_infos[d];
+    }
+    if (mass_index) {
+      cur.outputs.push_back(prefix + ".dat");
+      out_infos.push_back(info.dump());
+    } else for (unsigned i=0; i+1<mass_edges.size(); ++i) {
+      info["M"] = { mass_edges[i], mass_edges[i+1] };
+      cur.outputs.push_back(
+        cat(prefix,'_',mass_edges[i],'-',mass_edges[i+1],".dat"));
+      out_infos.push_back(info.dump());
     }
   }
+  const unsigned nouts = cur.outputs.size();
+  if (reuse && old.outputs!=cur.outputs)
+    throw std::runtime_error("manifest outputs do not match the config");
+
+  // The outputs are about to change, so the manifest is removed
+  // until the new one is saved, and a run that is killed before that
+  // does not leave outputs that a later run would wrongly reuse
+  if (std::remove(manifest_name.c_str()) && errno!=ENOENT)
+    throw std::runtime_error(cat("cannot remove ",manifest_name));
 
-  if (jet_alg) {
-    fastjet::ClusterSequence::print_banner(); // get it out of the way
-    cout << jet_alg->description() <<'\n'<< endl;
+  // Binned outputs are written directly,
+  // unless they have to be merged with the old ones
+  mass_binners<mass_bin> files;
+  if (!mass_index && !reuse) {
+    files.reserve(ndefs);
+    for (unsigned d=0, k=0; d<ndefs; ++d) {
+      files.emplace_back(mass_edges);
+      for (auto& bin : files[d].bins()) {
+        if (resume) bin.resume(writer,cur.outputs[k],out_infos[k],fields,
+          state_from_json(checkpoint.at("outputs").at(k)));
+        else bin.open(writer,cur.outputs[k],out_infos[k],fields);
+        ++k;
+      }
+    }
   }
-  std::vector<fj::PseudoJet> particles;
+
+  // Writing after the loop is added to the write stage
+  using clock = std::chrono::steady_clock;
+  using sec = std::chrono::duration<double>;
+  auto timed_write = [&](auto&& f) {
+    if (!stage_timing) return f();
+    const auto t0 = clock::now();
+    f();
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    stats.t[run_stats::write] += sec(clock::now()-t0).count();
+  };
+
+  // Flush the buffers and report write errors
+  auto close_files = [&]{
+    timed_write([&]{
+      for (auto& bins : files)
+        for (auto& bin : bins.bins()) bin.close();
+    });
+  };
 
   // LOOP ===========================================================
-  using cnt = ivanp::timed_counter<Long64_t>;
-  for (cnt ent(reader.GetEntries(true)); reader.Next(); ++ent) {
-    // Read particles -----------------------------------------------
-    vec4 Higgs;
-    particles.clear();
-    const unsigned np = *_nparticle;
-    for (unsigned i=0; i<np; ++i) {
-      if (_kf[i]==25) {
-        Higgs = {_px[i],_py[i],_pz[i],_E[i]};
-      } else {
-        particles.emplace_back(_px[i],_py[i],_pz[i],_E[i]);
-      }
+  const auto loop_start = clock::now();
+  stats_printer live_stats(stats_every,loop_start);
+
+  file_counts counts(src.names.size());
+  if (resume) {
+    counts = checkpoint.at("counts").get<file_counts>();
+    const auto& v = checkpoint.at("validation");
+    if (validation && !v.is_null()) {
+      validation->nevents = v[0];
+      validation->nmismatch = v[1];
+      validation->t_fastjet = v[2];
+      validation->t_native = v[3];
+    }
+  }
+
+  auto save_checkpoint = [&](Long64_t entry) {
+    nlohmann::json j {
+      {"config",cur.config}, {"inputs",checkpoint_inputs(cur)},
+      {"entry",entry}, {"outputs",nlohmann::json::array()},
+      {"counts",counts}, {"validation",nullptr}
+    };
+    for (auto& bins : files)
+      for (auto& bin : bins.bins())
+        j["outputs"].push_back(state_to_json(bin.checkpoint()));
+    if (validation) {
+      const auto& v = *validation;
+      j["validation"] = { v.nevents, v.nmismatch, v.t_fastjet, v.t_native };
+    }
+    write_checkpoint(checkpoint_name,j);
+  };
+  auto loop = [&](
+    Long64_t a, Long64_t b, auto& outs, file_counts& counts, auto&& tick
+  ) {
+    if (cache) event_loop(*cache,a,b,jdefs,outs,counts,tick);
+    else event_loop(src,a,b,jdefs,outs,counts,tick);
+  };
+
+  using cnt = progress_counter;
+
+  // Run the loop as a pipeline
+  // consume is called with the output of every block, in entry order
+  auto run_pipeline = [&](auto make_out, auto&& consume) {
+    ROOT::EnableThreadSafety();
+    cout << "Running a pipeline with " << npipeline << " workers" << endl;
+    pipeline_loop(src,first,last,jdefs,npipeline,make_out,[&](auto& out){
+      timed_write([&]{ consume(out); });
+    },counts);
+  };
+
+  // Run the loop in several threads
+  // Returns the outputs of each thread, in entry order
+  auto run_threads = [&](auto make_out) {
+    ROOT::EnableThreadSafety();
+    std::vector<Long64_t> edges;
+    if (cache || reuse) {
+      // events in the cache can be split anywhere
+      // and the chain does not match a partial input
+      for (unsigned t=0; t<nthreads; ++t)
+        edges.push_back(first + (last-first)*t/nthreads);
+      edges.push_back(last);
+    } else edges = split_entries(chain,first,last,nthreads);
+    nthreads = edges.size()-1;
+    cout << "Running " << nthreads << " threads" << endl;
+
+    std::vector<decltype(make_out())> outs;
+    outs.reserve(nthreads);
+    std::vector<file_counts> thread_counts(nthreads,counts);
+    std::vector<std::exception_ptr> errors(nthreads);
+    std::vector<std::thread> threads;
+    threads.reserve(nthreads);
+    std::atomic<Long64_t> nproc(0);
+    std::atomic<unsigned> nfinished(0);
+
+    for (unsigned t=0; t<nthreads; ++t) {
+      outs.emplace_back(make_out());
+      threads.emplace_back([&,t]{
+        constexpr Long64_t ntick = 1 << 12;
+        Long64_t n = 0;
+        try {
+          loop(edges[t],edges[t+1],outs[t],thread_counts[t],[&]{
+            if (!(++n % ntick)) nproc += ntick;
+          });
+        } catch (...) {
+          errors[t] = std::current_exception();
+        }
+        nproc += n % ntick;
+        ++nfinished;
+      });
     }
-    // --------------------------------------------------------------
 
-    // Cluster jets -------------------------------------------------
-    auto fj_jets = (jet_alg && particles.size() > 1)
-     ? fj::ClusterSequence(particles,*jet_alg).inclusive_jets()
-     : particles;
-    for (auto it=fj_jets.end(); it!=fj_jets.begin(); ) { // apply cuts
-      --it;
-      for (const auto& cut : jet_cuts)
-        if (cut(*it)) { fj_jets.erase(it); break; }
+    { cnt ent(last-first);
+      for (bool done=false; !done; ) {
+        done = (nfinished == nthreads);
+        if (!done)
+          std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        for (const Long64_t n = nproc; ent < n; ++ent) ;
+      }
     }
-    if (fj_jets.empty()) continue;
-    std::sort( fj_jets.begin(), fj_jets.end(), // sort by pT
-      [](const auto& a, const auto& b){ return ( a.pt() > b.pt() ); });
-    // --------------------------------------------------------------
-    const vec4 jet = fj_jets.front();
+    for (auto& thread : threads) thread.join();
+    for (auto& e : errors) if (e) std::rethrow_exception(e);
+    for (const auto& c : thread_counts) counts += c;
+    return outs;
+  };
+
+  // Write through a temporary file, so that the old output
+  // can be read while the new one is written
+  auto write_output = [&](unsigned k, auto&& fill, unsigned sort_field = 0) {
+    const std::string& name = cur.outputs[k];
+    const std::string tmp = name + ".tmp";
+    timed_write([&]{
+      dat_writer f;
+      f.open(writer,tmp,out_infos[k],fields,sort_field);
+      fill(f);
+      f.close();
+    });
+    if (std::rename(tmp.c_str(),name.c_str()))
+      throw std::runtime_error(cat("cannot rename ",tmp," to ",name));
+  };
 
-    const auto Q = Higgs + jet;
-    const double Q2 = Q*Q; // Mass^2
+  // Old output k, checked against the manifest
+  auto open_old = [&](unsigned k) {
+    std::unique_ptr<dat_file> f(new dat_file(cur.outputs[k]));
+    Long64_t n = 0;
+    for (const auto& file : old.files) n += file.counts.at(k);
+    if (f->nfields()!=fields.size() || Long64_t(f->nevents())!=n)
+      throw std::runtime_error(cat(
+        cur.outputs[k]," does not match ",manifest_name));
+    return f;
+  };
 
-    const vec4 Z(0,0,Q[3],Q[2]);
-    const auto ell = ((Q*jet)/Q2)*Higgs - ((Q*Higgs)/Q2)*jet;
+  if (mass_index) {
+    // One file per jet definition, sorted by mass
+    std::vector<std::vector<mass_events>> outs;
+    if (npipeline) {
+      outs.emplace_back(ndefs);
+      run_pipeline([&]{ return std::vector<mass_events>(ndefs); },
+      [&](std::vector<mass_events>& out){
+        for (unsigned d=0; d<ndefs; ++d) {
+          auto& events = outs[0][d];
+          events.recs.insert(events.recs.end(),
+            out[d].recs.begin(),out[d].recs.end());
+          events.mass.insert(events.mass.end(),
+            out[d].mass.begin(),out[d].mass.end());
+        }
+      });
+    } else if (nthreads < 2) {
+      outs.emplace_back(ndefs);
+      cnt ent(first,last);
+      loop(first,last,outs[0],counts,[&]{ ++ent; });
+    } else outs = run_threads([&]{ return std::vector<mass_events>(ndefs); });
 
-    event.cos_theta = (ell*Z) / std::sqrt(sq(ell)*sq(Z));
-    // --------------------------------------------------------------
+    fields.push_back("mass");
+    const unsigned nf = fields.size();
+    for (unsigned d=0; d<ndefs; ++d) {
+      mass_events events = std::move(outs[0][d]);
+      for (unsigned t=1; t<outs.size(); ++t) {
+        auto& out = outs[t][d];
+        events.recs.insert(events.recs.end(),out.recs.begin(),out.recs.end());
+        events.mass.insert(events.mass.end(),out.mass.begin(),out.mass.end());
+        out = mass_events(); // free memory
+      }
+      // stable, so that output does not depend on the number of threads
+      std::vector<size_t> order(events.mass.size());
+      for (size_t i=0; i<order.size(); ++i) order[i] = i;
+      std::stable_sort(order.begin(),order.end(),[&](size_t a, size_t b){
+        return events.mass[a] < events.mass[b];
+      });
 
-    event.weight = (*_weight);
+      // New files were appended, so the old records go first
+      // among records of equal mass, as in a full run
+      std::unique_ptr<dat_file> old_f;
+      if (reuse) old_f = open_old(d);
+      write_output(d,[&](dat_writer& f){
+        const double* o = old_f ? old_f->records() : nullptr;
+        const double* const o_end = old_f ? o + old_f->nevents()*nf : o;
+        for (size_t i : order) {
+          for (; o!=o_end && o[nf-1] <= events.mass[i]; o+=nf) f(o);
+          f(events.recs.data() + i*nf);
+        }
+        for (; o!=o_end; o+=nf) f(o);
+      },nf);
+      cout << iftty("\033[36m") << "Wrote " << iftty("\033[0m")
+           << cur.outputs[d] << endl;
+    }
+  } else if (reuse) {
+    std::vector<mass_binners<mass_bin_buffer>> outs;
+    auto make_out = [&]{
+      return mass_binners<mass_bin_buffer>(
+        ndefs,mass_binner<mass_bin_buffer>(mass_edges));
+    };
+    if (npipeline) {
+      run_pipeline(make_out,[&](mass_binners<mass_bin_buffer>& out){
+        outs.emplace_back(make_out());
+        std::swap(outs.back(),out);
+      });
+    } else if (nthreads < 2) {
+      outs.emplace_back(make_out());
+      cnt ent(nent);
+      loop(0,nent,outs[0],counts,[&]{ ++ent; });
+    } else outs = run_threads(make_out);
+    for (auto& c : counts) c.resize(nouts); // files without passing events
 
-    files(std::sqrt(Q2));
+    // Put together segments of old and new records in file order
+    const unsigned nf = fields.size(), nbins = mass_edges.size()-1;
+    for (unsigned k=0; k<nouts; ++k) {
+      const unsigned d = k/nbins, b = k%nbins;
+      const auto old_f = open_old(k);
+      write_output(k,[&](dat_writer& f){
+        const double* o = old_f->records();
+        unsigned t = 0; // new records are read thread by thread
+        size_t pos = 0;
+        for (unsigned i=0, j=0; i<nfiles; ++i) {
+          Long64_t n;
+          if (reused[i] < 0) { // new records of todo file j
+            for (n=counts[j++][k]; n; --n, pos+=nf) {
+              while (pos == outs[t][d].bins()[b].size()) ++t, pos = 0;
+              f(outs[t][d].bins()[b].data() + pos);
+            }
+          } else { // old records of the same file
+            const double* seg = o;
+            for (unsigned jj=0; jj<unsigned(reused[i]); ++jj)
+              seg += old.files[jj].counts[k]*nf;
+            for (n=old.files[reused[i]].counts[k]; n; --n, seg+=nf) f(seg);
+          }
+        }
+      });
+    }
+  } else if (npipeline) {
+    // outputs of blocks arrive in entry order and are written directly
+    run_pipeline([&]{
+      return mass_binners<mass_bin_buffer>(
+        ndefs,mass_binner<mass_bin_buffer>(mass_edges));
+    },[&](mass_binners<mass_bin_buffer>& out){
+      for (unsigned d=0; d<ndefs; ++d)
+        for (unsigned i=0, n=files[d].nbins(); i<n; ++i)
+          files[d].bins()[i].write(out[d].bins()[i]);
+    });
+    close_files();
+  } else if (nthreads < 2) {
+    // with checkpoints, the loop runs in chunks
+    // and the state is saved after each one
+    const Long64_t start =
+      resume ? checkpoint.at("entry").get<Long64_t>() : first;
+    cnt ent(start,last);
+    for (Long64_t a=start; a<last; ) {
+      const Long64_t b =
+        checkpoint_every ? std::min(a+checkpoint_every,last) : last;
+      loop(a,b,files,counts,[&]{ ++ent; });
+      if ((a = b) < last) save_checkpoint(a);
+    }
+    close_files();
+    if (checkpoint_every) std::remove(checkpoint_name.c_str());
+  } else {
+    auto outs = run_threads([&]{
+      return mass_binners<mass_bin_buffer>(
+        ndefs,mass_binner<mass_bin_buffer>(mass_edges));
+    });
+    // Write in entry order, so that output matches a serial run
+    timed_write([&]{
+      for (unsigned d=0; d<ndefs; ++d)
+        for (unsigned i=0, n=files[d].nbins(); i<n; ++i)
+          for (const auto& out : outs)
+            files[d].bins()[i].write(out[d].bins()[i]);
+    });
+    close_files();
   }
-}
 
+  // Stats ==========================================================
+  // Stage times are summed over threads, so they can exceed wall time
+  live_stats.stop();
+  const double wall = sec(clock::now()-loop_start).count();
+  {
+    nlohmann::json j {
+      {"input", cache ? "cache" : "ntuples"},
+      {"threads",npipeline ? npipeline : nthreads},
+      {"pipeline",npipeline > 0}, {"wall",wall},
+      {"events",stats.nevents}, {"bytes_read",stats.bytes},
+      {"events_per_s",stats.nevents/wall},
+      {"MB_per_s",stats.bytes/wall*1e-6},
+      {"stages",nlohmann::json::object()},
+      {"outputs",nlohmann::json::object()}
+    };
+    if (stage_timing)
+      for (unsigned s=0; s<run_stats::nstages; ++s)
+        j["stages"][run_stats::name(s)] = stats.t[s];
+    stats.records.resize(nouts);
+    for (unsigned k=0; k<nouts; ++k) {
+      const Long64_t n = stats.records[k];
+      j["outputs"][cur.outputs[k]] = {
+        {"records",n},
+        {"acceptance",stats.nevents ? double(n)/stats.nevents : 0.} };
+    }
+    std::ofstream(cat(ofname,".stats.json")) << j.dump(1) << '\n';
+  }
+  cout << iftty("\033[34m") << "Throughput" << iftty("\033[0m") << ": "
+       << stats.summary(wall) << endl;
+
+  // Record the inputs of the outputs,
+  // unless they were read from the cache or only a shard was processed
+  if (!cache && !nshards) {
+    for (unsigned i=0, j=0; i<nfiles; ++i) {
+      auto& file = cur.files[i];
+      file.entries = in.nentries[i];
+      if (reused[i] < 0) {
+        const auto& c = counts[reuse ? j++ : i];
+        file.counts.assign(c.begin(),c.end());
+        file.counts.resize(nouts);
+      } else file.counts = old.files[reused[i]].counts;
+    }
+    cur.save(manifest_name);
+  }
+
+  print_validation();
+}